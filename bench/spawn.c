@@ -0,0 +1,109 @@
+/*
+ * See LICENSE file for copyright and license details.
+ *
+ * Time fork()+exec() against posix_spawn() as the parent's resident set
+ * grows, the way it does for a long running compositor.
+ *
+ * usage: spawn [-n count] [mib ...]
+ */
+#include <errno.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+extern char **environ;
+
+static char *argv_true[] = {"/bin/true", NULL};
+
+static void
+die(const char *s)
+{
+	perror(s);
+	exit(1);
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static void
+runfork(void)
+{
+	pid_t pid;
+
+	if ((pid = fork()) < 0)
+		die("fork");
+	if (pid == 0) {
+		execv(argv_true[0], argv_true);
+		_exit(127);
+	}
+	if (waitpid(pid, NULL, 0) < 0)
+		die("waitpid");
+}
+
+static void
+runspawn(void)
+{
+	pid_t pid;
+
+	if ((errno = posix_spawn(&pid, argv_true[0], NULL, NULL, argv_true, environ)))
+		die("posix_spawn");
+	if (waitpid(pid, NULL, 0) < 0)
+		die("waitpid");
+}
+
+static double
+bench(void (*run)(void), int n)
+{
+	double start = now();
+	int i;
+
+	for (i = 0; i < n; i++)
+		run();
+	return (now() - start) / n;
+}
+
+int
+main(int argc, char *argv[])
+{
+	static const char *defsizes[] = {"0", "64", "256", "1024"};
+	const char **sizes = defsizes;
+	int nsizes = 4, n = 200, c, i;
+	size_t mib, have = 0;
+	char *mem = NULL;
+
+	while ((c = getopt(argc, argv, "n:")) != -1) {
+		if (c == 'n' && (n = atoi(optarg)) > 0)
+			continue;
+		fprintf(stderr, "usage: %s [-n count] [mib ...]\n", argv[0]);
+		return 1;
+	}
+	if (optind < argc) {
+		sizes = (const char **)argv + optind;
+		nsizes = argc - optind;
+	}
+
+	printf("%8s %12s %12s\n", "rss MiB", "fork us", "spawn us");
+	for (i = 0; i < nsizes; i++) {
+		mib = strtoul(sizes[i], NULL, 10);
+		/* Touch every page so it is really resident */
+		if (mib > have) {
+			if (!(mem = realloc(mem, mib << 20)))
+				die("realloc");
+			memset(mem + (have << 20), 1, (mib - have) << 20);
+			have = mib;
+		}
+		printf("%8zu %12.1f %12.1f\n", have,
+				bench(runfork, n), bench(runspawn, n));
+	}
+	free(mem);
+	return 0;
+}
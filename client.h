@@ -182,6 +182,18 @@ client_get_geometry(Client *c, struct wlr_box *geom)
 	wlr_xdg_surface_get_geometry(c->surface.xdg, geom);
 }
 
+static inline pid_t
+client_get_pid(Client *c)
+{
+	pid_t pid;
+#ifdef XWAYLAND
+	if (client_is_x11(c))
+		return c->surface.xwayland->pid;
+#endif
+	wl_client_get_credentials(c->surface.xdg->client->client, &pid, NULL, NULL);
+	return pid;
+}
+
 static inline Client *
 client_get_parent(Client *c)
 {
@@ -240,6 +252,23 @@ client_is_mapped(Client *c)
 	return c->surface.xdg->mapped;
 }
 
+static inline int
+client_is_opaque(Client *c)
+{
+	/* Whether the surface promises to cover everything inside the borders.
+	 * Those show the xdg geometry, which starts past any CSD shadow */
+	struct wlr_box geom = {0};
+	pixman_box32_t box;
+	if (!client_is_x11(c))
+		client_get_geometry(c, &geom);
+	box.x1 = geom.x;
+	box.y1 = geom.y;
+	box.x2 = geom.x + c->geom.width - 2 * c->bw;
+	box.y2 = geom.y + c->geom.height - 2 * c->bw;
+	return pixman_region32_contains_rectangle(&client_surface(c)->opaque_region,
+			&box) == PIXMAN_REGION_IN;
+}
+
 static inline int
 client_is_rendered_on_mon(Client *c, Monitor *m)
 {
@@ -255,32 +284,6 @@ client_is_rendered_on_mon(Client *c, Monitor *m)
 	return 0;
 }
 
-static inline int
-client_is_stopped(Client *c)
-{
-	int pid;
-	siginfo_t in = {0};
-#ifdef XWAYLAND
-	if (client_is_x11(c))
-		return 0;
-#endif
-
-	wl_client_get_credentials(c->surface.xdg->client->client, &pid, NULL, NULL);
-	if (waitid(P_PID, pid, &in, WNOHANG|WCONTINUED|WSTOPPED|WNOWAIT) < 0) {
-		/* This process is not our child process, while is very unluckely that
-		 * it is stopped, in order to do not skip frames assume that it is. */
-		if (errno == ECHILD)
-			return 1;
-	} else if (in.si_pid) {
-		if (in.si_code == CLD_STOPPED || in.si_code == CLD_TRAPPED)
-			return 1;
-		if (in.si_code == CLD_CONTINUED)
-			return 0;
-	}
-
-	return 0;
-}
-
 static inline int
 client_is_unmanaged(Client *c)
 {
@@ -12,19 +12,37 @@ static const float focuscolor[]            = COLOR(0x005577ff);
 static const float urgentcolor[]           = COLOR(0xff0000ff);
 /* To conform the xdg-protocol, set the alpha to zero to restore the old behavior */
 static const float fullscreen_bg[]         = {0.1, 0.1, 0.1, 1.0}; /* You can also use glsl colors */
+/* Time in ms to hold back frames while tiled clients resize, stale buffers are
+ * stretched after that. 0 means wait for them forever */
+static const int resize_timeout            = 50;
+/* Frame events per second for clients completely hidden behind opaque ones,
+ * 0 means none until they show up again */
+static const int occluded_fps              = 1;
 
 /* tagging - TAGCOUNT must be no greater than 31 */
 #define TAGCOUNT (9)
 
+/* status output, 1 means only lines that changed are written, see dwl(1) */
+static const int status_incremental = 0;
+/* bytes queued for an IPC client before it gets disconnected, see dwl(1) */
+static const size_t ipc_queue_max = 64 * 1024;
+
+/* 1 means commands are launched by a helper process forked at startup */
+static const int spawn_helper = 0;
+
 /* logging */
 static int log_level = WLR_ERROR;
 
+/* fps caps the frame events a client gets per second, unfocusedfps does so
+ * while it is not focused. 0 means no cap */
 static const Rule rules[] = {
-	/* app_id     title       tags mask     isfloating   monitor */
+	/* app_id     title       tags mask     isfloating   monitor  fps  unfocusedfps */
 	/* examples:
-	{ "Gimp",     NULL,       0,            1,           -1 },
+	{ "Gimp",     NULL,       0,            1,           -1,      0,   0 },
+	{ "grafana",  NULL,       0,            0,           -1,      10,  0 },
+	{ "mpv",      NULL,       0,            0,           -1,      0,   30 },
 	*/
-	{ "firefox",  NULL,       1 << 8,       0,           -1 },
+	{ "firefox",  NULL,       1 << 8,       0,           -1,      0,   0 },
 };
 
 /* layout(s) */
@@ -57,6 +75,10 @@ static const struct xkb_rule_names xkb_rules = {
 static const int repeat_rate = 25;
 static const int repeat_delay = 600;
 
+/* 1 means pointer motion is handled at most once per output frame, which helps
+ * with high polling rate mice. The cursor itself still moves on every event */
+static const int coalesce_motion = 0;
+
 /* Trackpad */
 static const int tap_to_click = 1;
 static const int tap_and_drag = 1;
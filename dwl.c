@@ -1,13 +1,21 @@
 /*
  * See LICENSE file for copyright and license details.
  */
+#define _GNU_SOURCE /* POSIX_SPAWN_SETSID */
+#include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
 #include <libinput.h>
 #include <limits.h>
 #include <linux/input-event-codes.h>
 #include <signal.h>
+#include <spawn.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
@@ -58,12 +66,14 @@
 #include <xcb/xcb_icccm.h>
 #endif
 
+#include "status.h"
 #include "util.h"
 
 /* macros */
 #define MAX(A, B)               ((A) > (B) ? (A) : (B))
 #define MIN(A, B)               ((A) < (B) ? (A) : (B))
 #define CLEANMASK(mask)         (mask & ~WLR_MODIFIER_CAPS)
+#define BINDID(mod, code)       ((uint64_t)CLEANMASK(mod) << 32 | (code))
 #define VISIBLEON(C, M)         ((M) && (C)->mon == (M) && ((C)->tags & (M)->tagset[(M)->seltags]))
 #define LENGTH(X)               (sizeof X / sizeof X[0])
 #define END(A)                  ((A) + LENGTH(A))
@@ -75,6 +85,9 @@
 enum { CurNormal, CurPressed, CurMove, CurResize }; /* cursor */
 enum { XDGShell, LayerShell, X11Managed, X11Unmanaged }; /* client types */
 enum { LyrBg, LyrBottom, LyrTile, LyrFloat, LyrFS, LyrTop, LyrOverlay, LyrBlock, NUM_LAYERS }; /* scene layers */
+enum { StatusTitle, StatusAppid, StatusFullscreen, StatusFloating, StatusSelmon,
+	StatusTags, StatusLayout, StatusLast }; /* status lines */
+enum { IpcNone, IpcInt, IpcUint, IpcFloat, IpcLayout }; /* IPC command arguments */
 #ifdef XWAYLAND
 enum { NetWMWindowTypeDialog, NetWMWindowTypeSplash, NetWMWindowTypeToolbar,
 	NetWMWindowTypeUtility, NetLast }; /* EWMH atoms */
@@ -87,6 +100,11 @@ typedef union {
 	const void *v;
 } Arg;
 
+typedef struct {
+	uint64_t id; /* BINDID() of the binding */
+	size_t i; /* index in keys[] or buttons[] */
+} Binding;
+
 typedef struct {
 	unsigned int mod;
 	unsigned int button;
@@ -105,6 +123,9 @@ typedef struct {
 	struct wlr_scene_tree *scene_surface;
 	struct wl_list link;
 	struct wl_list flink;
+	struct wl_list mlink; /* Monitor::clients */
+	struct wl_list mflink; /* Monitor::fstack */
+	struct wl_list rlink; /* Monitor::resizes */
 	union {
 		struct wlr_xdg_surface *xdg;
 		struct wlr_xwayland_surface *xwayland;
@@ -126,8 +147,32 @@ typedef struct {
 	uint32_t tags;
 	int isfloating, isurgent, isfullscreen;
 	uint32_t resize; /* configure serial of a pending resize */
+	pid_t pid; /* 0 unless the client is our child process */
+	int isstopped; /* only known for our children */
+	int occluded; /* hidden behind opaque clients, see occlude() */
+	int opaque; /* as of the last occlude() */
+	uint32_t lastframe; /* ms of the last frame event, if capped */
+	int fps, unfocusedfps; /* from rules[] */
+	struct wl_event_source *frame_timer; /* sends capped frame events */
 } Client;
 
+typedef struct {
+	const char *name;
+	void (*func)(const Arg *);
+	int arg; /* Ipc* */
+} IpcCommand;
+
+typedef struct {
+	struct wl_list link;
+	int fd;
+	struct wl_event_source *source;
+	int subscribed;
+	char in[256]; /* unfinished command line */
+	size_t inlen;
+	char *out; /* queued output, bounded by ipc_queue_max */
+	size_t outlen, outoff;
+} IpcClient;
+
 typedef struct {
 	uint32_t mod;
 	xkb_keysym_t keysym;
@@ -160,6 +205,10 @@ typedef struct {
 	struct wl_list link;
 	int mapped;
 	struct wlr_layer_surface_v1 *layer_surface;
+	int configured; /* the fields below are valid, see arrangelayer() */
+	struct wlr_layer_surface_v1_state state; /* last configured with */
+	int wasmapped;
+	struct wlr_box full_area, usable_in, usable_out;
 
 	struct wl_listener destroy;
 	struct wl_listener map;
@@ -167,6 +216,16 @@ typedef struct {
 	struct wl_listener surface_commit;
 } LayerSurface;
 
+typedef struct {
+	struct wlr_surface *surface; /* NULL if empty */
+	Client *c;
+	LayerSurface *l;
+	struct wlr_box box; /* layout-relative area of surface */
+	unsigned int gen; /* scenegen when it was filled */
+	struct wl_listener commit;
+	struct wl_listener destroy;
+} HitCache;
+
 typedef struct {
 	const char *symbol;
 	void (*arrange)(Monitor *);
@@ -183,7 +242,16 @@ struct Monitor {
 	struct wlr_session_lock_surface_v1 *lock_surface;
 	struct wlr_box m; /* monitor area, layout-relative */
 	struct wlr_box w; /* window area, layout-relative */
+	float scale; /* of the output when m was last laid out */
+	enum wl_output_transform transform; /* likewise */
+	int autoplace; /* placed by wlr_output_layout_add_auto() */
 	struct wl_list layers[4]; /* LayerSurface::link */
+	struct wl_list clients; /* Client::mlink, in tiling order */
+	struct wl_list fstack; /* Client::mflink, in focus order */
+	Client *top; /* cached focustop(), only valid if topvalid */
+	int topvalid;
+	struct wl_list resizes; /* Client::rlink, clients with a pending resize */
+	struct wl_event_source *resize_timer; /* deadline for the pending resizes */
 	const Layout *lt[2];
 	unsigned int seltags;
 	unsigned int sellt;
@@ -191,6 +259,11 @@ struct Monitor {
 	double mfact;
 	int nmaster;
 	char ltsymbol[16];
+	int dirty; /* arrange() was called, see arrangeidle() */
+	Client *cover; /* client hiding the others, see covermon() */
+	unsigned int nocc[32], nurg[32]; /* clients and urgent clients per tag */
+	uint32_t occ, urg; /* tags with clients, see countclient() */
+	char *status[StatusLast]; /* last written status, if status_incremental */
 };
 
 typedef struct {
@@ -209,8 +282,37 @@ typedef struct {
 	uint32_t tags;
 	int isfloating;
 	int monitor;
+	int fps; /* frame events per second, 0 means no cap */
+	int unfocusedfps; /* likewise, while not focused */
 } Rule;
 
+typedef struct {
+	char id[128]; /* make, model and serial of the display */
+	int32_t width, height, refresh;
+	int x, y;
+	enum wl_output_transform transform;
+	float scale;
+	int adaptive_sync;
+} OutputProfile;
+
+typedef struct {
+	struct wl_listener commit;
+	struct wl_listener destroy;
+} Popup;
+
+typedef struct {
+	int child, sibling; /* first child and next sibling in the trie */
+	int fail, dict; /* failure link and next node on it that ends a pattern */
+	int rule; /* first rule whose pattern ends here, -1 if none */
+	unsigned char c;
+} RuleNode;
+
+typedef struct {
+	RuleNode *nodes; /* Aho-Corasick automaton, the root is nodes[0] */
+	int *next; /* by rule, next rule with the same pattern */
+	unsigned *seen; /* by rule, rulegen of the last match */
+} RuleMatcher;
+
 typedef struct {
 	struct wlr_scene_tree *scene;
 
@@ -224,10 +326,12 @@ typedef struct {
 static void applybounds(Client *c, struct wlr_box *bbox);
 static void applyrules(Client *c);
 static void arrange(Monitor *m);
+static void arrangeidle(void *data);
 static void arrangelayer(Monitor *m, struct wl_list *list,
 		struct wlr_box *usable_area, int exclusive);
 static void arrangelayers(Monitor *m);
 static void axisnotify(struct wl_listener *listener, void *data);
+static int bindingcmp(const void *a, const void *b);
 static void buttonpress(struct wl_listener *listener, void *data);
 static void chvt(const Arg *arg);
 static void checkidleinhibitor(struct wlr_surface *exclude);
@@ -235,8 +339,14 @@ static void cleanup(void);
 static void cleanupkeyboard(struct wl_listener *listener, void *data);
 static void cleanupmon(struct wl_listener *listener, void *data);
 static void closemon(Monitor *m);
+static void commithitsurface(struct wl_listener *listener, void *data);
 static void commitlayersurfacenotify(struct wl_listener *listener, void *data);
 static void commitnotify(struct wl_listener *listener, void *data);
+static void commitpopup(struct wl_listener *listener, void *data);
+static void compilematcher(RuleMatcher *rm, int title);
+static void compilerules(void);
+static void countclient(Client *c, int n);
+static Client *covermon(Monitor *m);
 static void createdecoration(struct wl_listener *listener, void *data);
 static void createidleinhibitor(struct wl_listener *listener, void *data);
 static void createkeyboard(struct wlr_keyboard *keyboard);
@@ -245,31 +355,53 @@ static void createlocksurface(struct wl_listener *listener, void *data);
 static void createmon(struct wl_listener *listener, void *data);
 static void createnotify(struct wl_listener *listener, void *data);
 static void createpointer(struct wlr_pointer *pointer);
+static void createstatuspage(const char *display);
 static void cursorframe(struct wl_listener *listener, void *data);
+static void defermotion(uint32_t time);
 static void destroydragicon(struct wl_listener *listener, void *data);
+static void destroyhitsurface(struct wl_listener *listener, void *data);
 static void destroyidleinhibitor(struct wl_listener *listener, void *data);
 static void destroylayersurfacenotify(struct wl_listener *listener, void *data);
 static void destroylock(SessionLock *lock, int unlocked);
 static void destroylocksurface(struct wl_listener *listener, void *data);
 static void destroynotify(struct wl_listener *listener, void *data);
+static void destroypopup(struct wl_listener *listener, void *data);
 static void destroysessionlock(struct wl_listener *listener, void *data);
 static void destroysessionmgr(struct wl_listener *listener, void *data);
 static Monitor *dirtomon(enum wlr_direction dir);
+static size_t findbinding(const Binding *index, size_t n, uint64_t id);
+static void flushmotion(void);
+static int flushstatus(int fd, uint32_t mask, void *data);
+static OutputProfile *findprofile(struct wlr_output *wlr_output, int add);
 static void focusclient(Client *c, int lift);
 static void focusmon(const Arg *arg);
 static void focusstack(const Arg *arg);
 static Client *focustop(Monitor *m);
+static int framedue(void *data);
+static int frameinterval(Client *c);
 static void fullscreennotify(struct wl_listener *listener, void *data);
-static void handlesig(int signo);
+static int handlechild(int signo, void *data);
+static int handlesig(int signo, void *data);
 static void incnmaster(const Arg *arg);
+static void indexmons(void);
 static void inputdevice(struct wl_listener *listener, void *data);
+static int iscovered(Client *c, Monitor *m);
+static int ipcaccept(int fd, uint32_t mask, void *data);
+static void ipcdisconnect(IpcClient *ic);
+static int ipcexec(IpcClient *ic, char *line);
+static int ipcflush(IpcClient *ic);
+static void ipclisten(const char *display);
+static int ipcread(int fd, uint32_t mask, void *data);
+static int ipcsend(IpcClient *ic, const char *buf, size_t len);
 static int keybinding(uint32_t mods, xkb_keysym_t sym);
 static void keypress(struct wl_listener *listener, void *data);
 static void keypressmod(struct wl_listener *listener, void *data);
 static int keyrepeat(void *data);
 static void killclient(const Arg *arg);
+static void loadprofiles(void);
 static void locksession(struct wl_listener *listener, void *data);
 static void maplayersurfacenotify(struct wl_listener *listener, void *data);
+static int matchrules(RuleMatcher *rm, const char *s, int *hits);
 static void mapnotify(struct wl_listener *listener, void *data);
 static void maximizenotify(struct wl_listener *listener, void *data);
 static void monocle(Monitor *m);
@@ -277,9 +409,12 @@ static void motionabsolute(struct wl_listener *listener, void *data);
 static void motionnotify(uint32_t time);
 static void motionrelative(struct wl_listener *listener, void *data);
 static void moveresize(const Arg *arg);
+static int nodeintersects(struct wlr_scene_node *node, const struct wlr_box *box);
+static void occlude(void);
 static void outputmgrapply(struct wl_listener *listener, void *data);
 static void outputmgrapplyortest(struct wlr_output_configuration_v1 *config, int test);
 static void outputmgrtest(struct wl_listener *listener, void *data);
+static int packstrings(char **v, size_t *len);
 static void pointerfocus(Client *c, struct wlr_surface *surface,
 		double sx, double sy, uint32_t time);
 static void printstatus(void);
@@ -287,7 +422,14 @@ static void quit(const Arg *arg);
 static void rendermon(struct wl_listener *listener, void *data);
 static void requeststartdrag(struct wl_listener *listener, void *data);
 static void resize(Client *c, struct wlr_box geo, int interact);
+static int resyncstatus(int signo, void *data);
+static int resizeexpired(void *data);
+static int rulechild(RuleMatcher *rm, int node, unsigned char c);
+static int rulecmp(const void *a, const void *b);
+static const char *rulepattern(const Rule *r, int title);
 static void run(char *startup_cmd);
+static void saveprofiles(void);
+static void sendframe(struct wlr_scene_buffer *buffer, int sx, int sy, void *data);
 static void setcursor(struct wl_listener *listener, void *data);
 static void setfloating(Client *c, int floating);
 static void setfullscreen(Client *c, int fullscreen);
@@ -298,7 +440,12 @@ static void setpsel(struct wl_listener *listener, void *data);
 static void setsel(struct wl_listener *listener, void *data);
 static void setup(void);
 static void spawn(const Arg *arg);
+static void spawnhelper(int fd);
+static void stageoutput(const struct wlr_output_head_v1_state *state);
 static void startdrag(struct wl_listener *listener, void *data);
+static char *statussnapshot(int incremental, size_t *len);
+static void stretchbuffer(struct wlr_scene_buffer *buffer, int sx, int sy, void *data);
+static void surfaceframe(struct wlr_surface *surface, int sx, int sy, void *data);
 static void tag(const Arg *arg);
 static void tagmon(const Arg *arg);
 static void tile(Monitor *m);
@@ -306,23 +453,60 @@ static void togglefloating(const Arg *arg);
 static void togglefullscreen(const Arg *arg);
 static void toggletag(const Arg *arg);
 static void toggleview(const Arg *arg);
+static void trackresize(Client *c, Monitor *m);
 static void unlocksession(struct wl_listener *listener, void *data);
 static void unmaplayersurfacenotify(struct wl_listener *listener, void *data);
 static void unmapnotify(struct wl_listener *listener, void *data);
 static void updatemons(struct wl_listener *listener, void *data);
+static void updatestatuspage(void);
 static void updatetitle(struct wl_listener *listener, void *data);
 static void urgent(struct wl_listener *listener, void *data);
 static void view(const Arg *arg);
 static void virtualkeyboard(struct wl_listener *listener, void *data);
+static void writestatus(void *data);
 static Monitor *xytomon(double x, double y);
 static void xytonode(double x, double y, struct wlr_surface **psurface,
 		Client **pc, LayerSurface **pl, double *nx, double *ny);
 static void zoom(const Arg *arg);
 
 /* variables */
+extern char **environ;
 static const char broken[] = "broken";
 static const char *cursor_image = "left_ptr";
 static pid_t child_pid = -1;
+static int motion_pending; /* defermotion() is waiting for a frame */
+static uint32_t motion_time; /* of the deferred motion */
+static unsigned int scenegen; /* bumped whenever the scene may have changed */
+static int idlecheck; /* a client was shown or hidden, see arrangeidle() */
+static int occludedirty = 1; /* clients were moved or restacked */
+static struct timespec frametime; /* see sendframe() */
+static int idleinhibited = -1; /* as last told to wlroots */
+static HitCache hit = {.commit = {.notify = commithitsurface},
+	.destroy = {.notify = destroyhitsurface}}; /* last xytonode() hit */
+static struct wl_event_source *arrange_source;
+static struct wl_event_source *status_source; /* see printstatus() */
+static struct wl_event_source *status_writable;
+static char *statusbuf[2]; /* snapshot being written, newest one waiting */
+static size_t statuslen[2], statusoff;
+static const char *statusnames[] = { "title", "appid", "fullscreen", "floating",
+	"selmon", "tags", "layout" };
+static unsigned long statusseq;
+static int statusresync = 1; /* write everything next time */
+static int ipcfd = -1;
+static struct sockaddr_un ipcaddr;
+static struct wl_list ipcclients;
+static StatusPage *statuspage; /* see status.h */
+static char statuspath[PATH_MAX];
+static sigset_t origmask;
+static posix_spawnattr_t spawnattr;
+static posix_spawn_file_actions_t spawnactions;
+static int spawnfd = -1; /* socket to the spawn helper */
+static char spawnbuf[1 << 16];
+static Monitor **monindex; /* mons by position, for rules */
+static OutputProfile *profiles; /* last working state of each display */
+static size_t nprofiles;
+static char profilepath[PATH_MAX];
+static int monindexlen;
 static int locked;
 static void *exclusive_focus;
 static struct wl_display *dpy;
@@ -375,7 +559,6 @@ static struct wl_listener cursor_motion = {.notify = motionrelative};
 static struct wl_listener cursor_motion_absolute = {.notify = motionabsolute};
 static struct wl_listener drag_icon_destroy = {.notify = destroydragicon};
 static struct wl_listener idle_inhibitor_create = {.notify = createidleinhibitor};
-static struct wl_listener idle_inhibitor_destroy = {.notify = destroyidleinhibitor};
 static struct wl_listener layout_change = {.notify = updatemons};
 static struct wl_listener new_input = {.notify = inputdevice};
 static struct wl_listener new_virtual_keyboard = {.notify = virtualkeyboard};
@@ -410,6 +593,34 @@ static xcb_atom_t netatom[NetLast];
 /* configuration, allows nested code to access above variables */
 #include "config.h"
 
+/* commands accepted on the IPC socket, see dwl(1) */
+static const IpcCommand ipccommands[] = {
+	{ "view",             view,             IpcUint },
+	{ "toggleview",       toggleview,       IpcUint },
+	{ "tag",              tag,              IpcUint },
+	{ "toggletag",        toggletag,        IpcUint },
+	{ "focusstack",       focusstack,       IpcInt },
+	{ "incnmaster",       incnmaster,       IpcInt },
+	{ "setmfact",         setmfact,         IpcFloat },
+	{ "setlayout",        setlayout,        IpcLayout },
+	{ "zoom",             zoom,             IpcNone },
+	{ "killclient",       killclient,       IpcNone },
+	{ "togglefloating",   togglefloating,   IpcNone },
+	{ "togglefullscreen", togglefullscreen, IpcNone },
+	{ "quit",             quit,             IpcNone },
+};
+
+/* keys[] and buttons[] sorted by modifiers and keysym or button */
+static Binding keyindex[LENGTH(keys)];
+static Binding buttonindex[LENGTH(buttons)];
+
+/* rules[] compiled into one matcher for titles and one for app ids */
+static RuleMatcher titlematcher, idmatcher;
+static int anyrules[LENGTH(rules)]; /* rules without patterns */
+static int nanyrules;
+static int rulehits[2 * LENGTH(rules)];
+static unsigned rulegen;
+
 /* attempt to encapsulate suck into one file */
 #include "client.h"
 
@@ -446,9 +657,10 @@ applyrules(Client *c)
 {
 	/* rule matching */
 	const char *appid, *title;
-	uint32_t i, newtags = 0;
+	uint32_t newtags = 0;
+	int i, n;
 	const Rule *r;
-	Monitor *mon = selmon, *m;
+	Monitor *mon = selmon;
 
 	c->isfloating = client_is_float_type(c);
 	if (!(appid = client_get_appid(c)))
@@ -456,16 +668,27 @@ applyrules(Client *c)
 	if (!(title = client_get_title(c)))
 		title = broken;
 
-	for (r = rules; r < END(rules); r++) {
-		if ((!r->title || strstr(title, r->title))
-				&& (!r->id || strstr(appid, r->id))) {
-			c->isfloating = r->isfloating;
-			newtags |= r->tags;
-			i = 0;
-			wl_list_for_each(m, &mons, link)
-				if (r->monitor == i++)
-					mon = m;
-		}
+	/* Collect every rule that has a pattern in the title or app id, then
+	 * apply the ones that match completely in the order of rules[] */
+	rulegen++;
+	memcpy(rulehits, anyrules, nanyrules * sizeof(*anyrules));
+	n = nanyrules;
+	n += matchrules(&titlematcher, title, rulehits + n);
+	n += matchrules(&idmatcher, appid, rulehits + n);
+	qsort(rulehits, n, sizeof(*rulehits), rulecmp);
+
+	for (i = 0; i < n; i++) {
+		r = &rules[rulehits[i]];
+		if ((i > 0 && rulehits[i] == rulehits[i - 1])
+				|| (rulepattern(r, 1) && titlematcher.seen[rulehits[i]] != rulegen)
+				|| (rulepattern(r, 0) && idmatcher.seen[rulehits[i]] != rulegen))
+			continue;
+		c->isfloating = r->isfloating;
+		c->fps = r->fps;
+		c->unfocusedfps = r->unfocusedfps;
+		newtags |= r->tags;
+		if (r->monitor >= 0 && r->monitor < monindexlen)
+			mon = monindex[r->monitor];
 	}
 	wlr_scene_node_reparent(&c->scene->node, layers[c->isfloating ? LyrFloat : LyrTile]);
 	setmon(c, mon, newtags);
@@ -474,20 +697,53 @@ applyrules(Client *c)
 void
 arrange(Monitor *m)
 {
-	Client *c;
-	wl_list_for_each(c, &clients, link)
-		if (c->mon == m)
-			wlr_scene_node_set_enabled(&c->scene->node, VISIBLEON(c, m));
+	/* A single action often arranges the same monitor several times, so only
+	 * mark it here and lay it out once before going back to sleep */
+	strncpy(m->ltsymbol, m->lt[m->sellt]->symbol, LENGTH(m->ltsymbol));
+	m->dirty = 1;
+	if (!arrange_source)
+		arrange_source = wl_event_loop_add_idle(wl_display_get_event_loop(dpy),
+				arrangeidle, NULL);
+}
 
-	wlr_scene_node_set_enabled(&m->fullscreen_bg->node,
-			(c = focustop(m)) && c->isfullscreen);
+void
+arrangeidle(void *data)
+{
+	Client *c;
+	Monitor *m;
+	int visible;
 
-	strncpy(m->ltsymbol, m->lt[m->sellt]->symbol, LENGTH(m->ltsymbol));
+	arrange_source = NULL;
+	wl_list_for_each(m, &mons, link) {
+		if (!m->dirty)
+			continue;
+		m->dirty = 0;
+		/* The layout may raise a client, so it runs first */
+		if (m->lt[m->sellt]->arrange)
+			m->lt[m->sellt]->arrange(m);
+
+		/* Clients hidden behind a fullscreen client, or behind the top
+		 * one in monocle, are disabled as well. The scene then stops
+		 * sending them frame events, so they stop drawing */
+		m->cover = covermon(m);
+		wl_list_for_each(c, &m->clients, mlink) {
+			visible = VISIBLEON(c, m) && !iscovered(c, m);
+			if (c->scene->node.enabled == visible)
+				continue;
+			wlr_scene_node_set_enabled(&c->scene->node, visible);
+			idlecheck = 1;
+		}
 
-	if (m->lt[m->sellt]->arrange)
-		m->lt[m->sellt]->arrange(m);
+		wlr_scene_node_set_enabled(&m->fullscreen_bg->node,
+				(c = focustop(m)) && c->isfullscreen);
+	}
+	scenegen++;
+	occludedirty = 1;
 	motionnotify(0);
-	checkidleinhibitor(NULL);
+	/* Inhibitors only become visible or invisible with their client here,
+	 * and on map and unmap */
+	if (idlecheck)
+		checkidleinhibitor(NULL);
 }
 
 void
@@ -503,7 +759,28 @@ arrangelayer(Monitor *m, struct wl_list *list, struct wlr_box *usable_area, int
 		if (exclusive != (state->exclusive_zone > 0))
 			continue;
 
+		/* Configuring again with the same state and areas would give the
+		 * same result, so reuse that instead of sending a configure */
+		if (layersurface->configured
+				&& layersurface->wasmapped == wlr_layer_surface->mapped
+				&& layersurface->state.anchor == state->anchor
+				&& layersurface->state.exclusive_zone == state->exclusive_zone
+				&& layersurface->state.desired_width == state->desired_width
+				&& layersurface->state.desired_height == state->desired_height
+				&& !memcmp(&layersurface->state.margin, &state->margin, sizeof(state->margin))
+				&& !memcmp(&layersurface->full_area, &full_area, sizeof(full_area))
+				&& !memcmp(&layersurface->usable_in, usable_area, sizeof(*usable_area))) {
+			*usable_area = layersurface->usable_out;
+			continue;
+		}
+		layersurface->configured = 1;
+		layersurface->state = *state;
+		layersurface->wasmapped = wlr_layer_surface->mapped;
+		layersurface->full_area = full_area;
+		layersurface->usable_in = *usable_area;
+
 		wlr_scene_layer_surface_v1_configure(layersurface->scene_layer, &full_area, usable_area);
+		layersurface->usable_out = *usable_area;
 		wlr_scene_node_set_position(&layersurface->popups->node,
 				layersurface->scene->node.x, layersurface->scene->node.y);
 		layersurface->geom.x = layersurface->scene->node.x;
@@ -523,6 +800,7 @@ arrangelayers(Monitor *m)
 	LayerSurface *layersurface;
 	if (!m->wlr_output->enabled)
 		return;
+	scenegen++;
 
 	/* Arrange exclusive surfaces from top->bottom */
 	for (i = 3; i >= 0; i--)
@@ -543,6 +821,10 @@ arrangelayers(Monitor *m)
 				&m->layers[layers_above_shell[i]], link) {
 			if (!locked && layersurface->layer_surface->current.keyboard_interactive
 					&& layersurface->mapped) {
+				/* It may have the keyboard already */
+				if (exclusive_focus == layersurface && seat->keyboard_state.focused_surface
+						== layersurface->layer_surface->surface)
+					return;
 				/* Deactivate the focused client. */
 				focusclient(NULL, 0);
 				exclusive_focus = layersurface;
@@ -559,6 +841,7 @@ axisnotify(struct wl_listener *listener, void *data)
 	/* This event is forwarded by the cursor when a pointer emits an axis event,
 	 * for example when you move the scroll wheel. */
 	struct wlr_pointer_axis_event *event = data;
+	flushmotion();
 	IDLE_NOTIFY_ACTIVITY;
 	/* TODO: allow usage of scroll whell for mousebindings, it can be implemented
 	 * checking the event's orientation and the delta of the event */
@@ -568,15 +851,28 @@ axisnotify(struct wl_listener *listener, void *data)
 			event->delta_discrete, event->source);
 }
 
+int
+bindingcmp(const void *a, const void *b)
+{
+	/* Bindings for the same input stay in config order */
+	const Binding *ba = a, *bb = b;
+	if (ba->id != bb->id)
+		return ba->id < bb->id ? -1 : 1;
+	return ba->i < bb->i ? -1 : ba->i > bb->i;
+}
+
 void
 buttonpress(struct wl_listener *listener, void *data)
 {
 	struct wlr_pointer_button_event *event = data;
 	struct wlr_keyboard *keyboard;
 	uint32_t mods;
+	uint64_t id;
+	size_t i;
 	Client *c;
 	const Button *b;
 
+	flushmotion();
 	IDLE_NOTIFY_ACTIVITY;
 
 	switch (event->state) {
@@ -592,9 +888,11 @@ buttonpress(struct wl_listener *listener, void *data)
 
 		keyboard = wlr_seat_get_keyboard(seat);
 		mods = keyboard ? wlr_keyboard_get_modifiers(keyboard) : 0;
-		for (b = buttons; b < END(buttons); b++) {
-			if (CLEANMASK(mods) == CLEANMASK(b->mod) &&
-					event->button == b->button && b->func) {
+		id = BINDID(mods, event->button);
+		for (i = findbinding(buttonindex, LENGTH(buttons), id);
+				i < LENGTH(buttons) && buttonindex[i].id == id; i++) {
+			b = &buttons[buttonindex[i].i];
+			if (b->func) {
 				b->func(&b->arg);
 				return;
 			}
@@ -635,6 +933,7 @@ checkidleinhibitor(struct wlr_surface *exclude)
 {
 	int inhibited = 0, unused_lx, unused_ly;
 	struct wlr_idle_inhibitor_v1 *inhibitor;
+	idlecheck = 0;
 	wl_list_for_each(inhibitor, &idle_inhibit_mgr->inhibitors, link) {
 		struct wlr_surface *surface = wlr_surface_get_root_surface(inhibitor->surface);
 		struct wlr_scene_tree *tree = surface->data;
@@ -645,6 +944,9 @@ checkidleinhibitor(struct wlr_surface *exclude)
 		}
 	}
 
+	if (inhibited == idleinhibited)
+		return;
+	idleinhibited = inhibited;
 	wlr_idle_set_enabled(idle, NULL, !inhibited);
 	wlr_idle_notifier_v1_set_inhibited(idle_notifier, inhibited);
 }
@@ -656,10 +958,20 @@ cleanup(void)
 	wlr_xwayland_destroy(xwayland);
 #endif
 	wl_display_destroy_clients(dpy);
+	if (ipcfd >= 0)
+		unlink(ipcaddr.sun_path);
+	if (statuspage) {
+		munmap(statuspage, sizeof(*statuspage));
+		unlink(statuspath);
+	}
 	if (child_pid > 0) {
 		kill(child_pid, SIGTERM);
 		waitpid(child_pid, NULL, 0);
 	}
+	if (spawnfd >= 0)
+		close(spawnfd);
+	posix_spawn_file_actions_destroy(&spawnactions);
+	posix_spawnattr_destroy(&spawnattr);
 	wlr_backend_destroy(backend);
 	wlr_scene_node_destroy(&scene->tree.node);
 	wlr_renderer_destroy(drw);
@@ -698,12 +1010,20 @@ cleanupmon(struct wl_listener *listener, void *data)
 	wl_list_remove(&m->destroy.link);
 	wl_list_remove(&m->frame.link);
 	wl_list_remove(&m->link);
+	indexmons();
+	wl_event_source_remove(m->resize_timer);
+	for (i = 0; i < StatusLast; i++)
+		free(m->status[i]);
+	/* Otherwise readers wouldn't know the monitor is gone */
+	statusresync = 1;
 	m->wlr_output->data = NULL;
 	wlr_output_layout_remove(output_layout, m->wlr_output);
 	wlr_scene_output_destroy(m->scene_output);
 	wlr_scene_node_destroy(&m->fullscreen_bg->node);
 
 	closemon(m);
+	/* Its frame won't come anymore */
+	flushmotion();
 	free(m);
 }
 
@@ -733,6 +1053,13 @@ closemon(Monitor *m)
 	printstatus();
 }
 
+void
+commithitsurface(struct wl_listener *listener, void *data)
+{
+	/* Its size or input region may have changed */
+	scenegen++;
+}
+
 void
 commitlayersurfacenotify(struct wl_listener *listener, void *data)
 {
@@ -741,6 +1068,8 @@ commitlayersurfacenotify(struct wl_listener *listener, void *data)
 	struct wlr_output *wlr_output = wlr_layer_surface->output;
 	struct wlr_scene_tree *layer = layers[layermap[wlr_layer_surface->current.layer]];
 
+	scenegen++;
+
 	/* For some reason this layersurface have no monitor, this can be because
 	 * its monitor has just been destroyed */
 	if (!wlr_output || !(layersurface->mon = wlr_output->data))
@@ -769,9 +1098,135 @@ commitnotify(struct wl_listener *listener, void *data)
 {
 	Client *c = wl_container_of(listener, c, commit);
 
+	/* Its surface, or subsurfaces synchronized with it, may have changed.
+	 * X11 clients get here too, see mapnotify() */
+	scenegen++;
+
 	/* mark a pending resize as completed */
-	if (c->resize && c->resize <= c->surface.xdg->current.configure_serial)
+	if (c->resize && c->resize <= c->surface.xdg->current.configure_serial) {
 		c->resize = 0;
+		trackresize(c, c->mon);
+	}
+
+	if (client_is_opaque(c) != c->opaque)
+		occludedirty = 1;
+
+	/* It may have started or stopped hiding the other clients, as its
+	 * opaque region changed */
+	if (c->mon && (c == c->mon->cover || c->isfullscreen
+				|| c->mon->lt[c->mon->sellt]->arrange == monocle)
+			&& (covermon(c->mon) == c) != (c->mon->cover == c))
+		arrange(c->mon);
+}
+
+void
+commitpopup(struct wl_listener *listener, void *data)
+{
+	/* It may have been repositioned, or changed its size or input region */
+	scenegen++;
+}
+
+void
+compilematcher(RuleMatcher *rm, int title)
+{
+	/* Build a trie of the patterns, then add failure links breadth first */
+	const char *p;
+	size_t i, n = 1;
+	int node, child, f, t, head = 0, tail = 0, *queue;
+
+	for (i = 0; i < LENGTH(rules); i++)
+		if ((p = rulepattern(&rules[i], title)))
+			n += strlen(p);
+	rm->nodes = ecalloc(n, sizeof(*rm->nodes));
+	rm->next = ecalloc(LENGTH(rules), sizeof(*rm->next));
+	rm->seen = ecalloc(LENGTH(rules), sizeof(*rm->seen));
+	queue = ecalloc(n, sizeof(*queue));
+	rm->nodes[0] = (RuleNode){.child = -1, .sibling = -1, .dict = -1, .rule = -1};
+
+	for (i = 0, n = 1; i < LENGTH(rules); i++) {
+		if (!(p = rulepattern(&rules[i], title)))
+			continue;
+		for (node = 0; *p; p++, node = child) {
+			if ((child = rulechild(rm, node, *p)) >= 0)
+				continue;
+			child = n++;
+			rm->nodes[child] = (RuleNode){.child = -1, .sibling = rm->nodes[node].child,
+				.dict = -1, .rule = -1, .c = *p};
+			rm->nodes[node].child = child;
+		}
+		rm->next[i] = rm->nodes[node].rule;
+		rm->nodes[node].rule = i;
+	}
+
+	for (child = rm->nodes[0].child; child >= 0; child = rm->nodes[child].sibling)
+		queue[tail++] = child;
+	while (head < tail) {
+		node = queue[head++];
+		for (child = rm->nodes[node].child; child >= 0; child = rm->nodes[child].sibling) {
+			for (f = rm->nodes[node].fail;
+					(t = rulechild(rm, f, rm->nodes[child].c)) < 0 && f;
+					f = rm->nodes[f].fail);
+			rm->nodes[child].fail = f = t < 0 ? 0 : t;
+			rm->nodes[child].dict = rm->nodes[f].rule >= 0 ? f : rm->nodes[f].dict;
+			queue[tail++] = child;
+		}
+	}
+	free(queue);
+}
+
+void
+compilerules(void)
+{
+	int i;
+	for (i = 0; i < LENGTH(rules); i++)
+		if (!rulepattern(&rules[i], 0) && !rulepattern(&rules[i], 1))
+			anyrules[nanyrules++] = i;
+	compilematcher(&titlematcher, 1);
+	compilematcher(&idmatcher, 0);
+}
+
+void
+countclient(Client *c, int n)
+{
+	/* Add n to the per-tag counts of the monitor of c and keep its occ and urg
+	 * masks in sync. Called with -1 before changing the monitor, tags or
+	 * urgency of c and with +1 afterwards. */
+	Monitor *m = c->mon;
+	int i;
+	if (!m)
+		return;
+	for (i = 0; i < TAGCOUNT; i++) {
+		if (!(c->tags & 1 << i))
+			continue;
+		m->nocc[i] += n;
+		if (c->isurgent)
+			m->nurg[i] += n;
+		m->occ = m->nocc[i] ? m->occ | 1 << i : m->occ & ~(1 << i);
+		m->urg = m->nurg[i] ? m->urg | 1 << i : m->urg & ~(1 << i);
+	}
+}
+
+Client *
+covermon(Monitor *m)
+{
+	/* Return the client that hides the others on m, if any. A fullscreen
+	 * client hides everything below it if fullscreen_bg is opaque and shown
+	 * behind it, or if it is opaque itself. Only the topmost one counts */
+	Client *c;
+	struct wlr_scene_node *node;
+
+	wl_list_for_each_reverse(node, &layers[LyrFS]->children, link)
+		if ((c = node->data) && VISIBLEON(c, m) && c->isfullscreen)
+			return (fullscreen_bg[3] >= 1 && c == focustop(m))
+				|| client_is_opaque(c) ? c : NULL;
+	if (m->lt[m->sellt]->arrange != monocle)
+		return NULL;
+	/* monocle() gives all tiled clients the same box, the topmost hides
+	 * the rest if it is opaque */
+	wl_list_for_each_reverse(node, &layers[LyrTile]->children, link)
+		if ((c = node->data) && VISIBLEON(c, m))
+			return client_is_opaque(c) ? c : NULL;
+	return NULL;
 }
 
 void
@@ -785,7 +1240,9 @@ void
 createidleinhibitor(struct wl_listener *listener, void *data)
 {
 	struct wlr_idle_inhibitor_v1 *idle_inhibitor = data;
-	wl_signal_add(&idle_inhibitor->events.destroy, &idle_inhibitor_destroy);
+	struct wl_listener *destroy = ecalloc(1, sizeof(*destroy));
+	destroy->notify = destroyidleinhibitor;
+	wl_signal_add(&idle_inhibitor->events.destroy, destroy);
 
 	checkidleinhibitor(NULL);
 }
@@ -897,7 +1354,11 @@ createmon(struct wl_listener *listener, void *data)
 	/* This event is raised by the backend when a new output (aka a display or
 	 * monitor) becomes available. */
 	struct wlr_output *wlr_output = data;
+	struct wlr_output_head_v1_state state = {.output = wlr_output, .enabled = 1,
+		.scale = 1, .adaptive_sync_enabled = 1};
+	struct wlr_output_mode *mode;
 	const MonitorRule *r;
+	OutputProfile *p;
 	size_t i;
 	Monitor *m = wlr_output->data = ecalloc(1, sizeof(*m));
 	m->wlr_output = wlr_output;
@@ -907,41 +1368,68 @@ createmon(struct wl_listener *listener, void *data)
 	/* Initialize monitor state using configured rules */
 	for (i = 0; i < LENGTH(m->layers); i++)
 		wl_list_init(&m->layers[i]);
+	wl_list_init(&m->clients);
+	wl_list_init(&m->fstack);
+	wl_list_init(&m->resizes);
+	m->resize_timer = wl_event_loop_add_timer(wl_display_get_event_loop(dpy),
+			resizeexpired, m);
 	m->tagset[0] = m->tagset[1] = 1;
 	for (r = monrules; r < END(monrules); r++) {
 		if (!r->name || strstr(wlr_output->name, r->name)) {
 			m->mfact = r->mfact;
 			m->nmaster = r->nmaster;
-			wlr_output_set_scale(wlr_output, r->scale);
-			wlr_xcursor_manager_load(cursor_mgr, r->scale);
+			state.scale = r->scale;
 			m->lt[0] = m->lt[1] = r->lt;
-			wlr_output_set_transform(wlr_output, r->rr);
+			state.transform = r->rr;
 			m->m.x = r->x;
 			m->m.y = r->y;
 			break;
 		}
 	}
 
-	/* The mode is a tuple of (width, height, refresh rate), and each
-	 * monitor supports only a specific set of modes. We just pick the
-	 * monitor's preferred mode; a more sophisticated compositor would let
-	 * the user configure it. */
-	wlr_output_set_mode(wlr_output, wlr_output_preferred_mode(wlr_output));
+	/* Everything is tested before the single commit, so hotplugging takes
+	 * one modeset. Try the state this display had last time first */
+	if ((p = findprofile(wlr_output, 0))) {
+		struct wlr_output_head_v1_state saved = {.output = wlr_output, .enabled = 1,
+			.custom_mode = {p->width, p->height, p->refresh},
+			.transform = p->transform, .scale = p->scale,
+			.adaptive_sync_enabled = p->adaptive_sync};
+		wl_list_for_each(mode, &wlr_output->modes, link)
+			if (mode->width == p->width && mode->height == p->height
+					&& mode->refresh == p->refresh)
+				saved.mode = mode;
+		stageoutput(&saved);
+		if (wlr_output_test(wlr_output)) {
+			state = saved;
+			m->m.x = p->x;
+			m->m.y = p->y;
+		} else {
+			wlr_output_rollback(wlr_output);
+			p = NULL;
+		}
+	}
+
+	/* Otherwise use the monitor rule and pick the monitor's preferred mode.
+	 * The mode is a tuple of (width, height, refresh rate), and each monitor
+	 * supports only a specific set of modes. Not all monitors support
+	 * adaptive sync either */
+	if (!p) {
+		state.mode = wlr_output_preferred_mode(wlr_output);
+		stageoutput(&state);
+		if (!wlr_output_test(wlr_output))
+			wlr_output_enable_adaptive_sync(wlr_output, 0);
+	}
+	wlr_xcursor_manager_load(cursor_mgr, state.scale);
 
 	/* Set up event listeners */
 	LISTEN(&wlr_output->events.frame, &m->frame, rendermon);
 	LISTEN(&wlr_output->events.destroy, &m->destroy, cleanupmon);
 
-	wlr_output_enable(wlr_output, 1);
 	if (!wlr_output_commit(wlr_output))
 		return;
 
-	/* Try to enable adaptive sync, note that not all monitors support it.
-	 * wlr_output_commit() will deactivate it in case it cannot be enabled */
-	wlr_output_enable_adaptive_sync(wlr_output, 1);
-	wlr_output_commit(wlr_output);
-
 	wl_list_insert(&mons, &m->link);
+	indexmons();
 	printstatus();
 
 	/* The xdg-protocol specifies:
@@ -963,7 +1451,7 @@ createmon(struct wl_listener *listener, void *data)
 	 * output (such as DPI, scale factor, manufacturer, etc).
 	 */
 	m->scene_output = wlr_scene_output_create(scene, wlr_output);
-	if (m->m.x < 0 || m->m.y < 0)
+	if ((m->autoplace = m->m.x < 0 || m->m.y < 0))
 		wlr_output_layout_add_auto(output_layout, wlr_output);
 	else
 		wlr_output_layout_add(output_layout, wlr_output, m->m.x, m->m.y);
@@ -981,14 +1469,21 @@ createnotify(struct wl_listener *listener, void *data)
 	struct wlr_xdg_surface *xdg_surface = data;
 	Client *c = NULL;
 	LayerSurface *l = NULL;
+	siginfo_t in = {0};
 
 	if (xdg_surface->role == WLR_XDG_SURFACE_ROLE_POPUP) {
 		struct wlr_box box;
+		Popup *p;
 		int type = toplevel_from_wlr_surface(xdg_surface->surface, &c, &l);
-		if (!xdg_surface->popup->parent || type < 0)
+		if (!xdg_surface->popup->parent || !xdg_surface->popup->parent->data
+				|| type < 0)
 			return;
 		xdg_surface->surface->data = wlr_scene_xdg_surface_create(
 				xdg_surface->popup->parent->data, xdg_surface);
+		scenegen++;
+		p = ecalloc(1, sizeof(*p));
+		LISTEN(&xdg_surface->surface->events.commit, &p->commit, commitpopup);
+		LISTEN(&xdg_surface->events.destroy, &p->destroy, destroypopup);
 		if ((l && !l->mon) || (c && !c->mon))
 			return;
 		box = type == LayerShell ? l->mon->m : c->mon->w;
@@ -1003,6 +1498,17 @@ createnotify(struct wl_listener *listener, void *data)
 	c = xdg_surface->data = ecalloc(1, sizeof(*c));
 	c->surface.xdg = xdg_surface;
 	c->bw = borderpx;
+	wl_list_init(&c->mlink);
+	wl_list_init(&c->mflink);
+	wl_list_init(&c->rlink);
+
+	/* Stop notifications are only delivered for our own children, any other
+	 * client is assumed to be running */
+	c->pid = client_get_pid(c);
+	if (waitid(P_PID, c->pid, &in, WEXITED|WSTOPPED|WCONTINUED|WNOHANG|WNOWAIT) < 0)
+		c->pid = 0;
+	else if (in.si_pid)
+		c->isstopped = in.si_code == CLD_STOPPED || in.si_code == CLD_TRAPPED;
 
 	LISTEN(&xdg_surface->events.map, &c->map, mapnotify);
 	LISTEN(&xdg_surface->events.unmap, &c->unmap, unmapnotify);
@@ -1058,6 +1564,32 @@ createpointer(struct wlr_pointer *pointer)
 	wlr_cursor_attach_input_device(cursor, &pointer->base);
 }
 
+void
+createstatuspage(const char *display)
+{
+	/* A file on the runtime dir, usually a tmpfs, that readers can map
+	 * without having to talk to us first */
+	const char *dir = getenv("XDG_RUNTIME_DIR");
+	void *page;
+	int fd;
+
+	if (!dir || snprintf(statuspath, sizeof(statuspath), "%s/%s-dwl.status",
+				dir, display) >= sizeof(statuspath)
+			|| (fd = open(statuspath, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600)) < 0) {
+		fprintf(stderr, "failed to setup status page, continuing without it\n");
+		return;
+	}
+	if (ftruncate(fd, sizeof(*statuspage)) < 0 || (page = mmap(NULL,
+			sizeof(*statuspage), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+		fprintf(stderr, "failed to setup status page, continuing without it\n");
+		unlink(statuspath);
+	} else {
+		statuspage = page;
+		setenv("DWL_STATUS", statuspath, 1);
+	}
+	close(fd);
+}
+
 void
 cursorframe(struct wl_listener *listener, void *data)
 {
@@ -1065,10 +1597,32 @@ cursorframe(struct wl_listener *listener, void *data)
 	 * event. Frame events are sent after regular pointer events to group
 	 * multiple events together. For instance, two axis events may happen at the
 	 * same time, in which case a frame event won't be sent in between. */
+	/* Deferred motion sends its own frame once it's processed */
+	if (motion_pending)
+		return;
 	/* Notify the client with pointer focus of the frame event. */
 	wlr_seat_pointer_notify_frame(seat);
 }
 
+void
+defermotion(uint32_t time)
+{
+	/* The cursor has already moved, the rest of motionnotify() waits for the
+	 * next frame of the output under it, see flushmotion() */
+	Monitor *m = xytomon(cursor->x, cursor->y);
+	/* There won't be any frame to wait for */
+	if (!m || !m->wlr_output->enabled) {
+		motion_pending = 0;
+		motionnotify(time);
+		return;
+	}
+	/* This is a no-op if a frame is already scheduled, and otherwise makes
+	 * sure the motion isn't stuck on an output that went away */
+	wlr_output_schedule_frame(m->wlr_output);
+	motion_pending = 1;
+	motion_time = time;
+}
+
 void
 destroydragicon(struct wl_listener *listener, void *data)
 {
@@ -1079,12 +1633,22 @@ destroydragicon(struct wl_listener *listener, void *data)
 	motionnotify(0);
 }
 
+void
+destroyhitsurface(struct wl_listener *listener, void *data)
+{
+	wl_list_remove(&hit.commit.link);
+	wl_list_remove(&hit.destroy.link);
+	hit.surface = NULL;
+}
+
 void
 destroyidleinhibitor(struct wl_listener *listener, void *data)
 {
 	/* `data` is the wlr_surface of the idle inhibitor being destroyed,
 	 * at this point the idle inhibitor is still in the list of the manager */
 	checkidleinhibitor(wlr_surface_get_root_surface(data));
+	wl_list_remove(&listener->link);
+	free(listener);
 }
 
 void
@@ -1109,6 +1673,7 @@ destroylock(SessionLock *lock, int unlock)
 		goto destroy;
 
 	wlr_scene_node_set_enabled(&locked_bg->node, 0);
+	scenegen++;
 
 	focusclient(focustop(selmon), 0);
 	motionnotify(0);
@@ -1162,9 +1727,21 @@ destroynotify(struct wl_listener *listener, void *data)
 		wl_list_remove(&c->activate.link);
 	}
 #endif
+	if (c->frame_timer)
+		wl_event_source_remove(c->frame_timer);
 	free(c);
 }
 
+void
+destroypopup(struct wl_listener *listener, void *data)
+{
+	Popup *p = wl_container_of(listener, p, destroy);
+	wl_list_remove(&p->commit.link);
+	wl_list_remove(&p->destroy.link);
+	free(p);
+	scenegen++;
+}
+
 void
 destroysessionlock(struct wl_listener *listener, void *data)
 {
@@ -1195,6 +1772,97 @@ dirtomon(enum wlr_direction dir)
 	return selmon;
 }
 
+size_t
+findbinding(const Binding *index, size_t n, uint64_t id)
+{
+	/* Index of the first binding for id, or of the next one if there's none */
+	size_t lo = 0, hi = n, mid;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (index[mid].id < id)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+OutputProfile *
+findprofile(struct wlr_output *wlr_output, int add)
+{
+	/* Displays are told apart by their EDID, not by the connector, unless
+	 * it has no serial to tell identical ones apart */
+	char id[sizeof(profiles->id)];
+	size_t i;
+
+	if (wlr_output->serial && *wlr_output->serial)
+		snprintf(id, sizeof(id), "%s %s %s", wlr_output->make, wlr_output->model,
+				wlr_output->serial);
+	else
+		snprintf(id, sizeof(id), "%s %s %s", wlr_output->make, wlr_output->model,
+				wlr_output->name);
+	for (i = 0; i < nprofiles; i++)
+		if (!strcmp(profiles[i].id, id))
+			return &profiles[i];
+	if (!add)
+		return NULL;
+	if (!(profiles = realloc(profiles, (nprofiles + 1) * sizeof(*profiles))))
+		die("realloc:");
+	memset(&profiles[nprofiles], 0, sizeof(*profiles));
+	strcpy(profiles[nprofiles].id, id);
+	return &profiles[nprofiles++];
+}
+
+void
+flushmotion(void)
+{
+	/* Process the pointer motion deferred since the last frame, before
+	 * anything that depends on the pointer focus or selmon */
+	if (!motion_pending)
+		return;
+	motion_pending = 0;
+	motionnotify(motion_time);
+	wlr_seat_pointer_notify_frame(seat);
+}
+
+int
+flushstatus(int fd, uint32_t mask, void *data)
+{
+	/* Write out as much of the status as stdout takes without blocking, and
+	 * wait for it to become writable again if that isn't all of it */
+	ssize_t n;
+	while (statusbuf[0]) {
+		if (statusoff == statuslen[0]) {
+			free(statusbuf[0]);
+			statusbuf[0] = statusbuf[1];
+			statuslen[0] = statuslen[1];
+			statusbuf[1] = NULL;
+			statusoff = 0;
+			continue;
+		}
+		if ((n = write(STDOUT_FILENO, statusbuf[0] + statusoff,
+				statuslen[0] - statusoff)) >= 0) {
+			statusoff += n;
+		} else if (errno == EAGAIN) {
+			if (!status_writable)
+				status_writable = wl_event_loop_add_fd(wl_display_get_event_loop(dpy),
+						STDOUT_FILENO, WL_EVENT_WRITABLE, flushstatus, NULL);
+			return 0;
+		} else if (errno != EINTR) {
+			/* Nobody is reading, e.g. the status bar exited */
+			free(statusbuf[0]);
+			free(statusbuf[1]);
+			statusbuf[0] = statusbuf[1] = NULL;
+			statusoff = 0;
+		}
+	}
+	if (status_writable) {
+		wl_event_source_remove(status_writable);
+		status_writable = NULL;
+	}
+	return 0;
+}
+
 void
 focusclient(Client *c, int lift)
 {
@@ -1207,8 +1875,14 @@ focusclient(Client *c, int lift)
 		return;
 
 	/* Raise client in stacking order if requested */
-	if (c && lift)
+	if (c && lift) {
 		wlr_scene_node_raise_to_top(&c->scene->node);
+		scenegen++;
+		occludedirty = 1;
+		/* It may have been hidden behind the client it is raised above */
+		if (c->mon && c->mon->cover && c != c->mon->cover)
+			arrange(c->mon);
+	}
 
 	if (c && client_surface(c) == old)
 		return;
@@ -1223,8 +1897,15 @@ focusclient(Client *c, int lift)
 	if (c && !client_is_unmanaged(c)) {
 		wl_list_remove(&c->flink);
 		wl_list_insert(&fstack, &c->flink);
+		if (c->mon) {
+			wl_list_remove(&c->mflink);
+			wl_list_insert(&c->mon->fstack, &c->mflink);
+			c->mon->topvalid = 0;
+		}
 		selmon = c->mon;
+		countclient(c, -1);
 		c->isurgent = 0;
+		countclient(c, +1);
 		client_restack_surface(c);
 
 		/* Don't change border color if there is an exclusive focus or we are
@@ -1289,15 +1970,15 @@ focusstack(const Arg *arg)
 	if (!sel || sel->isfullscreen)
 		return;
 	if (arg->i > 0) {
-		wl_list_for_each(c, &sel->link, link) {
-			if (&c->link == &clients)
+		wl_list_for_each(c, &sel->mlink, mlink) {
+			if (&c->mlink == &selmon->clients)
 				continue; /* wrap past the sentinel node */
 			if (VISIBLEON(c, selmon))
 				break; /* found it */
 		}
 	} else {
-		wl_list_for_each_reverse(c, &sel->link, link) {
-			if (&c->link == &clients)
+		wl_list_for_each_reverse(c, &sel->mlink, mlink) {
+			if (&c->mlink == &selmon->clients)
 				continue; /* wrap past the sentinel node */
 			if (VISIBLEON(c, selmon))
 				break; /* found it */
@@ -1314,10 +1995,53 @@ Client *
 focustop(Monitor *m)
 {
 	Client *c;
-	wl_list_for_each(c, &fstack, flink)
-		if (VISIBLEON(c, m))
-			return c;
-	return NULL;
+	if (!m)
+		return NULL;
+	if (m->topvalid)
+		return m->top;
+
+	m->top = NULL;
+	m->topvalid = 1;
+	wl_list_for_each(c, &m->fstack, mflink) {
+		if (VISIBLEON(c, m)) {
+			m->top = c;
+			break;
+		}
+	}
+	return m->top;
+}
+
+int
+framedue(void *data)
+{
+	/* Capped clients get the frame events they missed in between output
+	 * frames from here, unless they were hidden or occluded in the meantime */
+	Client *c = data;
+	struct timespec now;
+
+	if (!client_is_mapped(c) || !c->scene->node.enabled || frameinterval(c) < 0)
+		return 0;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	c->lastframe = now.tv_sec * 1000 + now.tv_nsec / 1000000;
+	client_for_each_surface(c, surfaceframe, &now);
+	return 0;
+}
+
+int
+frameinterval(Client *c)
+{
+	/* Milliseconds between frame events for c, 0 means every output frame
+	 * and -1 none at all */
+	int fps = c->fps;
+	if (c->unfocusedfps && c != focustop(selmon) && (!fps || c->unfocusedfps < fps))
+		fps = c->unfocusedfps;
+	if (c->occluded) {
+		if (!occluded_fps)
+			return -1;
+		if (!fps || occluded_fps < fps)
+			fps = occluded_fps;
+	}
+	return fps ? 1000 / fps : 0;
 }
 
 void
@@ -1327,25 +2051,43 @@ fullscreennotify(struct wl_listener *listener, void *data)
 	setfullscreen(c, client_wants_fullscreen(c));
 }
 
-void
-handlesig(int signo)
+int
+handlechild(int signo, void *data)
 {
-	if (signo == SIGCHLD) {
+	/* SIGCHLD is read from the event loop, so several of them may have been
+	 * merged into one by the time we get here */
+	siginfo_t in = {0};
+	Client *c;
+
+	/* Record which of our children stopped or continued, so that rendermon()
+	 * doesn't have to ask the kernel every frame */
+	while (!waitid(P_ALL, 0, &in, WSTOPPED|WCONTINUED|WNOHANG) && in.si_pid)
+		wl_list_for_each(c, &clients, link)
+			if (c->pid == in.si_pid)
+				c->isstopped = in.si_code != CLD_CONTINUED;
+
 #ifdef XWAYLAND
-		siginfo_t in;
-		/* wlroots expects to reap the XWayland process itself, so we
-		 * use WNOWAIT to keep the child waitable until we know it's not
-		 * XWayland.
-		 */
-		while (!waitid(P_ALL, 0, &in, WEXITED|WNOHANG|WNOWAIT) && in.si_pid
-				&& (!xwayland || in.si_pid != xwayland->server->pid))
-			waitpid(in.si_pid, NULL, 0);
+	/* wlroots expects to reap the XWayland process itself, so we
+	 * use WNOWAIT to keep the child waitable until we know it's not
+	 * XWayland.
+	 */
+	while (!waitid(P_ALL, 0, &in, WEXITED|WNOHANG|WNOWAIT) && in.si_pid
+			&& (!xwayland || in.si_pid != xwayland->server->pid))
+		waitpid(in.si_pid, NULL, 0);
 #else
-		while (waitpid(-1, NULL, WNOHANG) > 0);
+	while (waitpid(-1, NULL, WNOHANG) > 0);
 #endif
-	} else if (signo == SIGINT || signo == SIGTERM) {
+	return 0;
+}
+
+int
+handlesig(int signo, void *data)
+{
+	/* SIGPIPE only needs to be kept from killing us, the write that raised
+	 * it fails with EPIPE */
+	if (signo == SIGINT || signo == SIGTERM)
 		quit(NULL);
-	}
+	return 0;
 }
 
 void
@@ -1357,6 +2099,18 @@ incnmaster(const Arg *arg)
 	arrange(selmon);
 }
 
+void
+indexmons(void)
+{
+	Monitor *m;
+	int n = wl_list_length(&mons);
+	if (n && !(monindex = realloc(monindex, n * sizeof(*monindex))))
+		die("realloc:");
+	monindexlen = 0;
+	wl_list_for_each(m, &mons, link)
+		monindex[monindexlen++] = m;
+}
+
 void
 inputdevice(struct wl_listener *listener, void *data)
 {
@@ -1387,6 +2141,221 @@ inputdevice(struct wl_listener *listener, void *data)
 	wlr_seat_set_capabilities(seat, caps);
 }
 
+int
+iscovered(Client *c, Monitor *m)
+{
+	struct wlr_box box;
+	if (!m->cover || c == m->cover)
+		return 0;
+	/* Clients partly on another monitor stay visible there */
+	if (m->cover->isfullscreen)
+		return wlr_box_intersection(&box, &c->geom, &m->m)
+			&& !memcmp(&box, &c->geom, sizeof(box));
+	return !c->isfloating && !c->isfullscreen;
+}
+
+int
+ipcaccept(int fd, uint32_t mask, void *data)
+{
+	IpcClient *ic;
+	int cfd;
+	if ((cfd = accept(fd, NULL, NULL)) < 0)
+		return 0;
+	fcntl(cfd, F_SETFD, FD_CLOEXEC);
+	fcntl(cfd, F_SETFL, fcntl(cfd, F_GETFL) | O_NONBLOCK);
+
+	ic = ecalloc(1, sizeof(*ic));
+	ic->fd = cfd;
+	ic->source = wl_event_loop_add_fd(wl_display_get_event_loop(dpy), cfd,
+			WL_EVENT_READABLE, ipcread, ic);
+	wl_list_insert(&ipcclients, &ic->link);
+	return 0;
+}
+
+void
+ipcdisconnect(IpcClient *ic)
+{
+	wl_event_source_remove(ic->source);
+	close(ic->fd);
+	wl_list_remove(&ic->link);
+	free(ic->out);
+	free(ic);
+}
+
+int
+ipcexec(IpcClient *ic, char *line)
+{
+	/* Run a single command line, returns -1 if ic was dropped meanwhile */
+	const IpcCommand *cmd;
+	char *arg, *end = "";
+	size_t len;
+	Arg a = {0};
+	long n;
+
+	if ((arg = strchr(line, ' ')))
+		*arg++ = '\0';
+	if (!strcmp(line, "subscribe")) {
+		ic->subscribed = 1;
+		if (!(line = statussnapshot(0, &len)))
+			return 0;
+		n = ipcsend(ic, line, len);
+		free(line);
+		return n;
+	}
+
+	for (cmd = ipccommands; cmd < END(ipccommands); cmd++)
+		if (!strcmp(cmd->name, line))
+			break;
+	if (cmd == END(ipccommands))
+		return ipcsend(ic, "error unknown command\n", 22);
+	if (cmd->arg != IpcNone && (!arg || !*arg))
+		return ipcsend(ic, "error missing argument\n", 23);
+
+	switch (cmd->arg) {
+	case IpcInt:
+		a.i = strtol(arg, &end, 0);
+		break;
+	case IpcUint:
+		a.ui = strtoul(arg, &end, 0);
+		break;
+	case IpcFloat:
+		a.f = strtof(arg, &end);
+		break;
+	case IpcLayout:
+		if ((n = strtol(arg, &end, 0)) < 0 || n >= LENGTH(layouts))
+			return ipcsend(ic, "error bad argument\n", 19);
+		a.v = &layouts[n];
+		break;
+	}
+	if (*end)
+		return ipcsend(ic, "error bad argument\n", 19);
+
+	cmd->func(&a);
+	return ipcsend(ic, "ok\n", 3);
+}
+
+int
+ipcflush(IpcClient *ic)
+{
+	/* Write out what the socket takes without blocking, returns -1 if ic was
+	 * dropped because of an error */
+	ssize_t n;
+	while (ic->outoff < ic->outlen) {
+		if ((n = write(ic->fd, ic->out + ic->outoff, ic->outlen - ic->outoff)) >= 0) {
+			ic->outoff += n;
+		} else if (errno == EAGAIN) {
+			break;
+		} else if (errno != EINTR) {
+			ipcdisconnect(ic);
+			return -1;
+		}
+	}
+	if (ic->outoff == ic->outlen)
+		ic->outoff = ic->outlen = 0;
+	wl_event_source_fd_update(ic->source,
+			WL_EVENT_READABLE | (ic->outlen ? WL_EVENT_WRITABLE : 0));
+	return 0;
+}
+
+void
+ipclisten(const char *display)
+{
+	/* The socket goes next to the Wayland one, the Wayland socket lock makes
+	 * sure no other compositor uses this name */
+	const char *dir = getenv("XDG_RUNTIME_DIR");
+	ipcaddr.sun_family = AF_UNIX;
+	if (!dir || snprintf(ipcaddr.sun_path, sizeof(ipcaddr.sun_path), "%s/%s-dwl.sock",
+				dir, display) >= sizeof(ipcaddr.sun_path)
+			|| (ipcfd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+		goto fail;
+	fcntl(ipcfd, F_SETFD, FD_CLOEXEC);
+	fcntl(ipcfd, F_SETFL, fcntl(ipcfd, F_GETFL) | O_NONBLOCK);
+	unlink(ipcaddr.sun_path);
+	if (bind(ipcfd, (struct sockaddr *)&ipcaddr, sizeof(ipcaddr)) < 0
+			|| listen(ipcfd, 8) < 0) {
+		close(ipcfd);
+		ipcfd = -1;
+		goto fail;
+	}
+	wl_event_loop_add_fd(wl_display_get_event_loop(dpy), ipcfd,
+			WL_EVENT_READABLE, ipcaccept, NULL);
+	setenv("DWL_SOCKET", ipcaddr.sun_path, 1);
+	return;
+
+fail:
+	fprintf(stderr, "failed to setup IPC socket, continuing without it\n");
+}
+
+int
+ipcread(int fd, uint32_t mask, void *data)
+{
+	IpcClient *ic = data;
+	char *line, *nl;
+	ssize_t n;
+
+	if (mask & WL_EVENT_WRITABLE && ipcflush(ic) < 0)
+		return 0;
+
+	while (mask & WL_EVENT_READABLE) {
+		if ((n = read(fd, ic->in + ic->inlen, sizeof(ic->in) - ic->inlen)) < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN)
+				break;
+		}
+		if (n <= 0) {
+			ipcdisconnect(ic);
+			return 0;
+		}
+		ic->inlen += n;
+
+		line = ic->in;
+		while ((nl = memchr(line, '\n', ic->in + ic->inlen - line))) {
+			*nl = '\0';
+			if (ipcexec(ic, line) < 0)
+				return 0;
+			line = nl + 1;
+		}
+		/* Keep the unfinished line, which has to fit in the buffer */
+		ic->inlen -= line - ic->in;
+		if (ic->inlen == sizeof(ic->in)) {
+			ipcdisconnect(ic);
+			return 0;
+		}
+		memmove(ic->in, line, ic->inlen);
+	}
+
+	if (mask & (WL_EVENT_HANGUP | WL_EVENT_ERROR))
+		ipcdisconnect(ic);
+	return 0;
+}
+
+int
+ipcsend(IpcClient *ic, const char *buf, size_t len)
+{
+	/* Queue buf for ic and start writing it. A client that lets its queue grow
+	 * beyond ipc_queue_max is dropped instead of slowing us down. Returns -1
+	 * if ic is gone. */
+	char *out;
+	if (ic->outlen - ic->outoff + len > ipc_queue_max) {
+		ipcdisconnect(ic);
+		return -1;
+	}
+	if (ic->outoff) {
+		memmove(ic->out, ic->out + ic->outoff, ic->outlen - ic->outoff);
+		ic->outlen -= ic->outoff;
+		ic->outoff = 0;
+	}
+	if (!(out = realloc(ic->out, ic->outlen + len))) {
+		ipcdisconnect(ic);
+		return -1;
+	}
+	ic->out = out;
+	memcpy(ic->out + ic->outlen, buf, len);
+	ic->outlen += len;
+	return ipcflush(ic);
+}
+
 int
 keybinding(uint32_t mods, xkb_keysym_t sym)
 {
@@ -1396,10 +2365,13 @@ keybinding(uint32_t mods, xkb_keysym_t sym)
 	 * processing.
 	 */
 	int handled = 0;
+	uint64_t id = BINDID(mods, sym);
+	size_t i;
 	const Key *k;
-	for (k = keys; k < END(keys); k++) {
-		if (CLEANMASK(mods) == CLEANMASK(k->mod) &&
-				sym == k->keysym && k->func) {
+	for (i = findbinding(keyindex, LENGTH(keys), id);
+			i < LENGTH(keys) && keyindex[i].id == id; i++) {
+		k = &keys[keyindex[i].i];
+		if (k->func) {
 			k->func(&k->arg);
 			handled = 1;
 		}
@@ -1425,6 +2397,7 @@ keypress(struct wl_listener *listener, void *data)
 	int handled = 0;
 	uint32_t mods = wlr_keyboard_get_modifiers(kb->wlr_keyboard);
 
+	flushmotion();
 	IDLE_NOTIFY_ACTIVITY;
 
 	/* On _press_ if there is no active screen locker,
@@ -1497,12 +2470,47 @@ killclient(const Arg *arg)
 		client_send_close(sel);
 }
 
+void
+loadprofiles(void)
+{
+	/* One display per line, see saveprofiles() */
+	const char *dir = getenv("XDG_CACHE_HOME"), *home = getenv("HOME");
+	OutputProfile *p;
+	char line[512];
+	FILE *f;
+	int n = -1, transform;
+
+	if (dir && *dir)
+		n = snprintf(profilepath, sizeof(profilepath), "%s/dwl-outputs", dir);
+	else if (home)
+		n = snprintf(profilepath, sizeof(profilepath), "%s/.cache/dwl-outputs", home);
+	if (n < 0 || n >= sizeof(profilepath)) {
+		profilepath[0] = '\0';
+		return;
+	}
+	if (!(f = fopen(profilepath, "r")))
+		return;
+	while (fgets(line, sizeof(line), f)) {
+		if (!(profiles = realloc(profiles, (nprofiles + 1) * sizeof(*profiles))))
+			die("realloc:");
+		p = &profiles[nprofiles];
+		if (sscanf(line, "%d %d %d %d %d %d %f %d %127[^\n]", &p->width, &p->height,
+				&p->refresh, &p->x, &p->y, &transform, &p->scale,
+				&p->adaptive_sync, p->id) != 9)
+			continue;
+		p->transform = transform;
+		nprofiles++;
+	}
+	fclose(f);
+}
+
 void
 locksession(struct wl_listener *listener, void *data)
 {
 	struct wlr_session_lock_v1 *session_lock = data;
 	SessionLock *lock;
 	wlr_scene_node_set_enabled(&locked_bg->node, 1);
+	scenegen++;
 	if (cur_lock) {
 		wlr_session_lock_v1_destroy(session_lock);
 		return;
@@ -1527,6 +2535,28 @@ maplayersurfacenotify(struct wl_listener *listener, void *data)
 {
 	LayerSurface *l = wl_container_of(listener, l, map);
 	motionnotify(0);
+	checkidleinhibitor(NULL);
+}
+
+int
+matchrules(RuleMatcher *rm, const char *s, int *hits)
+{
+	/* Store every rule with a pattern that occurs in s in hits, once */
+	int node = 0, next, d, i, n = 0;
+
+	for (; *s; s++) {
+		while ((next = rulechild(rm, node, *s)) < 0 && node)
+			node = rm->nodes[node].fail;
+		node = next < 0 ? 0 : next;
+		for (d = rm->nodes[node].rule >= 0 ? node : rm->nodes[node].dict;
+				d >= 0; d = rm->nodes[d].dict)
+			for (i = rm->nodes[d].rule; i >= 0; i = rm->next[i])
+				if (rm->seen[i] != rulegen) {
+					rm->seen[i] = rulegen;
+					hits[n++] = i;
+				}
+	}
+	return n;
 }
 
 void
@@ -1550,6 +2580,8 @@ mapnotify(struct wl_listener *listener, void *data)
 		LISTEN(&client_surface(c)->events.commit, &c->commit, commitnotify);
 	}
 	c->scene->node.data = c->scene_surface->node.data = c;
+	scenegen++;
+	occludedirty = 1;
 
 	/* Handle unmanaged clients first so we can return prior create borders */
 	if (client_is_unmanaged(c)) {
@@ -1599,6 +2631,7 @@ unset_fullscreen:
 	wl_list_for_each(w, &clients, link)
 		if (w != c && w->isfullscreen && m == w->mon && (w->tags & c->tags))
 			setfullscreen(w, 0);
+	checkidleinhibitor(NULL);
 }
 
 void
@@ -1619,7 +2652,7 @@ monocle(Monitor *m)
 	Client *c;
 	int n = 0;
 
-	wl_list_for_each(c, &clients, link) {
+	wl_list_for_each(c, &m->clients, mlink) {
 		if (!VISIBLEON(c, m) || c->isfloating || c->isfullscreen)
 			continue;
 		resize(c, m->w, 0);
@@ -1642,7 +2675,10 @@ motionabsolute(struct wl_listener *listener, void *data)
 	 * emits these events. */
 	struct wlr_pointer_motion_absolute_event *event = data;
 	wlr_cursor_warp_absolute(cursor, &event->pointer->base, event->x, event->y);
-	motionnotify(event->time_msec);
+	if (coalesce_motion)
+		defermotion(event->time_msec);
+	else
+		motionnotify(event->time_msec);
 }
 
 void
@@ -1712,7 +2748,10 @@ motionrelative(struct wl_listener *listener, void *data)
 	 * generated the event. You can pass NULL for the device if you want to move
 	 * the cursor around without any input. */
 	wlr_cursor_move(cursor, &event->pointer->base, event->delta_x, event->delta_y);
-	motionnotify(event->time_msec);
+	if (coalesce_motion)
+		defermotion(event->time_msec);
+	else
+		motionnotify(event->time_msec);
 }
 
 void
@@ -1744,6 +2783,77 @@ moveresize(const Arg *arg)
 	}
 }
 
+int
+nodeintersects(struct wlr_scene_node *node, const struct wlr_box *box)
+{
+	/* Whether node or anything below it is shown somewhere in box */
+	struct wlr_scene_tree *tree;
+	struct wlr_scene_rect *rect;
+	struct wlr_scene_buffer *buffer;
+	struct wlr_scene_surface *scene_surface;
+	struct wlr_scene_node *child;
+	struct wlr_box nbox = {0}, tmp;
+
+	if (!node->enabled)
+		return 0;
+	switch (node->type) {
+	case WLR_SCENE_NODE_TREE:
+		tree = wl_container_of(node, tree, node);
+		wl_list_for_each(child, &tree->children, link)
+			if (nodeintersects(child, box))
+				return 1;
+		return 0;
+	case WLR_SCENE_NODE_RECT:
+		rect = wl_container_of(node, rect, node);
+		nbox.width = rect->width;
+		nbox.height = rect->height;
+		break;
+	case WLR_SCENE_NODE_BUFFER:
+		buffer = wl_container_of(node, buffer, node);
+		if ((scene_surface = wlr_scene_surface_from_buffer(buffer))) {
+			nbox.width = scene_surface->surface->current.width;
+			nbox.height = scene_surface->surface->current.height;
+		} else if (buffer->buffer) {
+			/* Can't tell about scale or transform, take the worst case */
+			nbox.width = nbox.height = MAX(buffer->buffer->width,
+					buffer->buffer->height);
+		}
+		break;
+	}
+	wlr_scene_node_coords(node, &nbox.x, &nbox.y);
+	return wlr_box_intersection(&tmp, &nbox, box);
+}
+
+void
+occlude(void)
+{
+	/* Go through the clients from the top down, adding up the opaque ones,
+	 * to find those that are completely hidden. Layer surfaces are left out,
+	 * so this may only miss some */
+	pixman_region32_t opaque;
+	struct wlr_scene_node *node;
+	Client *c;
+	int i;
+
+	occludedirty = 0;
+	pixman_region32_init(&opaque);
+	for (i = LyrFS; i >= LyrTile; i--) {
+		wl_list_for_each_reverse(node, &layers[i]->children, link) {
+			if (!node->enabled || !(c = node->data))
+				continue;
+			c->occluded = pixman_region32_contains_rectangle(&opaque,
+					&(pixman_box32_t){c->geom.x, c->geom.y,
+					c->geom.x + c->geom.width, c->geom.y + c->geom.height})
+				== PIXMAN_REGION_IN;
+			if ((c->opaque = client_is_opaque(c)))
+				pixman_region32_union_rect(&opaque, &opaque, c->geom.x + c->bw,
+						c->geom.y + c->bw, c->geom.width - 2 * c->bw,
+						c->geom.height - 2 * c->bw);
+		}
+	}
+	pixman_region32_fini(&opaque);
+}
+
 void
 outputmgrapply(struct wl_listener *listener, void *data)
 {
@@ -1761,39 +2871,55 @@ outputmgrapplyortest(struct wlr_output_configuration_v1 *config, int test)
 	 * output_layout.change event, not here.
 	 */
 	struct wlr_output_configuration_head_v1 *config_head;
-	int ok = 1;
+	struct wlr_output_head_v1_state *old;
+	int i = 0, n = 0, ok = 1;
 
+	/* wlroots can't commit several outputs at once, so stage the new state
+	 * on every output and test all of them before anything is committed */
+	old = ecalloc(wl_list_length(&config->heads), sizeof(*old));
 	wl_list_for_each(config_head, &config->heads, link) {
 		struct wlr_output *wlr_output = config_head->state.output;
-		Monitor *m = wlr_output->data;
+		old[n++] = (struct wlr_output_head_v1_state){
+			.output = wlr_output,
+			.enabled = wlr_output->enabled,
+			.mode = wlr_output->current_mode,
+			.custom_mode = {wlr_output->width, wlr_output->height, wlr_output->refresh},
+			.transform = wlr_output->transform,
+			.scale = wlr_output->scale,
+			.adaptive_sync_enabled = wlr_output->adaptive_sync_status
+				== WLR_OUTPUT_ADAPTIVE_SYNC_ENABLED,
+		};
+		stageoutput(&config_head->state);
+		if (!(ok = wlr_output_test(wlr_output)))
+			break;
+	}
 
-		wlr_output_enable(wlr_output, config_head->state.enabled);
-		if (!config_head->state.enabled)
-			goto apply_or_test;
-		if (config_head->state.mode)
-			wlr_output_set_mode(wlr_output, config_head->state.mode);
-		else
-			wlr_output_set_custom_mode(wlr_output,
-					config_head->state.custom_mode.width,
-					config_head->state.custom_mode.height,
-					config_head->state.custom_mode.refresh);
-
-		/* Don't move monitors if position wouldn't change, this to avoid
-		 * wlroots marking the output as manually configured */
-		if (m->m.x != config_head->state.x || m->m.y != config_head->state.y)
-			wlr_output_layout_move(output_layout, wlr_output,
-					config_head->state.x, config_head->state.y);
-		wlr_output_set_transform(wlr_output, config_head->state.transform);
-		wlr_output_set_scale(wlr_output, config_head->state.scale);
-		wlr_output_enable_adaptive_sync(wlr_output,
-				config_head->state.adaptive_sync_enabled);
-
-apply_or_test:
-		if (test) {
-			ok &= wlr_output_test(wlr_output);
-			wlr_output_rollback(wlr_output);
+	/* Then commit them in a row. If one fails, the outputs committed before
+	 * it get their old state back */
+	wl_list_for_each(config_head, &config->heads, link) {
+		if (test || !ok) {
+			wlr_output_rollback(config_head->state.output);
+		} else if ((ok = wlr_output_commit(config_head->state.output))) {
+			i++;
 		} else {
-			ok &= wlr_output_commit(wlr_output);
+			wlr_output_rollback(config_head->state.output);
+			while (i-- > 0) {
+				stageoutput(&old[i]);
+				wlr_output_commit(old[i].output);
+			}
+		}
+	}
+	free(old);
+
+	/* Don't move monitors if position wouldn't change, this to avoid
+	 * wlroots marking the output as manually configured */
+	wl_list_for_each(config_head, &config->heads, link) {
+		Monitor *m = config_head->state.output->data;
+		if (ok && !test && config_head->state.enabled
+				&& (m->m.x != config_head->state.x || m->m.y != config_head->state.y)) {
+			m->autoplace = 0;
+			wlr_output_layout_move(output_layout, config_head->state.output,
+					config_head->state.x, config_head->state.y);
 		}
 	}
 
@@ -1814,6 +2940,19 @@ outputmgrtest(struct wl_listener *listener, void *data)
 	outputmgrapplyortest(config, 1);
 }
 
+int
+packstrings(char **v, size_t *len)
+{
+	size_t n;
+	for (; *v; v++) {
+		if ((n = strlen(*v) + 1) > sizeof(spawnbuf) - *len)
+			return 0;
+		memcpy(spawnbuf + *len, *v, n);
+		*len += n;
+	}
+	return 1;
+}
+
 void
 pointerfocus(Client *c, struct wlr_surface *surface, double sx, double sy,
 		uint32_t time)
@@ -1845,42 +2984,10 @@ pointerfocus(Client *c, struct wlr_surface *surface, double sx, double sy,
 void
 printstatus(void)
 {
-	Monitor *m = NULL;
-	Client *c;
-	uint32_t occ, urg, sel;
-	const char *appid, *title;
-
-	wl_list_for_each(m, &mons, link) {
-		occ = urg = 0;
-		wl_list_for_each(c, &clients, link) {
-			if (c->mon != m)
-				continue;
-			occ |= c->tags;
-			if (c->isurgent)
-				urg |= c->tags;
-		}
-		if ((c = focustop(m))) {
-			title = client_get_title(c);
-			appid = client_get_appid(c);
-			printf("%s title %s\n", m->wlr_output->name, title ? title : broken);
-			printf("%s appid %s\n", m->wlr_output->name, appid ? appid : broken);
-			printf("%s fullscreen %u\n", m->wlr_output->name, c->isfullscreen);
-			printf("%s floating %u\n", m->wlr_output->name, c->isfloating);
-			sel = c->tags;
-		} else {
-			printf("%s title \n", m->wlr_output->name);
-			printf("%s appid \n", m->wlr_output->name);
-			printf("%s fullscreen \n", m->wlr_output->name);
-			printf("%s floating \n", m->wlr_output->name);
-			sel = 0;
-		}
-
-		printf("%s selmon %u\n", m->wlr_output->name, m == selmon);
-		printf("%s tags %u %u %u %u\n", m->wlr_output->name, occ, m->tagset[m->seltags],
-				sel, urg);
-		printf("%s layout %s\n", m->wlr_output->name, m->ltsymbol);
-	}
-	fflush(stdout);
+	/* Status changes come in bursts, only write the state they end up in */
+	if (!status_source)
+		status_source = wl_event_loop_add_idle(wl_display_get_event_loop(dpy),
+				writestatus, NULL);
 }
 
 void
@@ -1896,19 +3003,22 @@ rendermon(struct wl_listener *listener, void *data)
 	 * generally at the output's refresh rate (e.g. 60Hz). */
 	Monitor *m = wl_container_of(listener, m, frame);
 	Client *c;
-	struct timespec now;
+
+	flushmotion();
 
 	/* Render if no XDG clients have an outstanding resize and are visible on
-	 * this monitor. */
-	wl_list_for_each(c, &clients, link)
-		if (c->resize && !c->isfloating && client_is_rendered_on_mon(c, m) && !client_is_stopped(c))
+	 * this monitor. Only clients on m->resizes can have one. */
+	wl_list_for_each(c, &m->resizes, rlink)
+		if (!c->isfloating && client_is_rendered_on_mon(c, m) && !c->isstopped)
 			goto skip;
 	wlr_scene_output_commit(m->scene_output);
 
 skip:
 	/* Let clients know a frame has been rendered */
-	clock_gettime(CLOCK_MONOTONIC, &now);
-	wlr_scene_output_send_frame_done(m->scene_output, &now);
+	if (occludedirty)
+		occlude();
+	clock_gettime(CLOCK_MONOTONIC, &frametime);
+	wlr_scene_output_for_each_buffer(m->scene_output, sendframe, m);
 }
 
 void
@@ -1941,10 +3051,65 @@ resize(Client *c, struct wlr_box geo, int interact)
 	wlr_scene_node_set_position(&c->border[1]->node, 0, c->geom.height - c->bw);
 	wlr_scene_node_set_position(&c->border[2]->node, 0, c->bw);
 	wlr_scene_node_set_position(&c->border[3]->node, c->geom.width - c->bw, c->bw);
+	scenegen++;
+	occludedirty = 1;
 
 	/* this is a no-op if size hasn't changed */
 	c->resize = client_set_size(c, c->geom.width - 2 * c->bw,
 			c->geom.height - 2 * c->bw);
+	trackresize(c, c->mon);
+}
+
+int
+resizeexpired(void *data)
+{
+	/* Some clients didn't ack the resizes of the current transaction in time.
+	 * Stop holding back frames for them and show their old buffers stretched
+	 * to the new geometry until they commit, so a single slow client can't
+	 * freeze the whole output. */
+	Monitor *m = data;
+	Client *c, *tmp;
+
+	wl_list_for_each_safe(c, tmp, &m->resizes, rlink) {
+		if (!c->isfloating)
+			wlr_scene_node_for_each_buffer(&c->scene_surface->node, stretchbuffer, c);
+		wl_list_remove(&c->rlink);
+		wl_list_init(&c->rlink);
+	}
+	wlr_output_schedule_frame(m->wlr_output);
+	return 0;
+}
+
+int
+rulechild(RuleMatcher *rm, int node, unsigned char c)
+{
+	int child;
+	for (child = rm->nodes[node].child; child >= 0; child = rm->nodes[child].sibling)
+		if (rm->nodes[child].c == c)
+			return child;
+	return -1;
+}
+
+int
+rulecmp(const void *a, const void *b)
+{
+	return *(const int *)a - *(const int *)b;
+}
+
+const char *
+rulepattern(const Rule *r, int title)
+{
+	/* An empty pattern is found in every string, just like no pattern */
+	const char *p = title ? r->title : r->id;
+	return p && *p ? p : NULL;
+}
+
+int
+resyncstatus(int signo, void *data)
+{
+	statusresync = 1;
+	printstatus();
+	return 0;
 }
 
 void
@@ -1955,6 +3120,8 @@ run(char *startup_cmd)
 	if (!socket)
 		die("startup: display_add_socket_auto");
 	setenv("WAYLAND_DISPLAY", socket, 1);
+	ipclisten(socket);
+	createstatuspage(socket);
 
 	/* Start the backend. This will enumerate outputs and inputs, become the DRM
 	 * master, etc */
@@ -1964,20 +3131,27 @@ run(char *startup_cmd)
 	/* Now that the socket exists and the backend is started, run the startup command */
 	if (startup_cmd) {
 		int piperw[2];
+		char *argv[] = {"/bin/sh", "-c", startup_cmd, NULL};
+		posix_spawnattr_t attr;
+		posix_spawn_file_actions_t actions;
 		if (pipe(piperw) < 0)
 			die("startup: pipe:");
-		if ((child_pid = fork()) < 0)
-			die("startup: fork:");
-		if (child_pid == 0) {
-			dup2(piperw[0], STDIN_FILENO);
-			close(piperw[0]);
-			close(piperw[1]);
-			execl("/bin/sh", "/bin/sh", "-c", startup_cmd, NULL);
-			die("startup: execl:");
-		}
+		posix_spawnattr_init(&attr);
+		posix_spawnattr_setsigmask(&attr, &origmask);
+		posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+		posix_spawn_file_actions_init(&actions);
+		posix_spawn_file_actions_adddup2(&actions, piperw[0], STDIN_FILENO);
+		posix_spawn_file_actions_addclose(&actions, piperw[0]);
+		posix_spawn_file_actions_addclose(&actions, piperw[1]);
+		if ((errno = posix_spawn(&child_pid, argv[0], &actions, &attr, argv, environ)))
+			die("startup: posix_spawn:");
+		posix_spawn_file_actions_destroy(&actions);
+		posix_spawnattr_destroy(&attr);
 		dup2(piperw[1], STDOUT_FILENO);
 		close(piperw[1]);
 		close(piperw[0]);
+		/* The pipe is ours alone, don't let a slow reader block us */
+		fcntl(STDOUT_FILENO, F_SETFL, fcntl(STDOUT_FILENO, F_GETFL) | O_NONBLOCK);
 	}
 	printstatus();
 
@@ -1999,6 +3173,86 @@ run(char *startup_cmd)
 	wl_display_run(dpy);
 }
 
+void
+saveprofiles(void)
+{
+	/* Remember the state of every enabled monitor, then write the cache to
+	 * a new file and rename it, so that it is never seen half written */
+	char tmp[PATH_MAX + 4];
+	OutputProfile *p;
+	Monitor *m;
+	FILE *f;
+	size_t i;
+
+	wl_list_for_each(m, &mons, link) {
+		if (!m->wlr_output->enabled)
+			continue;
+		p = findprofile(m->wlr_output, 1);
+		p->width = m->wlr_output->width;
+		p->height = m->wlr_output->height;
+		p->refresh = m->wlr_output->refresh;
+		/* Auto placed ones stay so, wherever the others end up */
+		p->x = m->autoplace ? -1 : m->m.x;
+		p->y = m->autoplace ? -1 : m->m.y;
+		p->transform = m->wlr_output->transform;
+		p->scale = m->wlr_output->scale;
+		p->adaptive_sync = m->wlr_output->adaptive_sync_status
+			== WLR_OUTPUT_ADAPTIVE_SYNC_ENABLED;
+	}
+
+	if (!profilepath[0])
+		return;
+	snprintf(tmp, sizeof(tmp), "%s.new", profilepath);
+	if (!(f = fopen(tmp, "w")))
+		return;
+	for (i = 0; i < nprofiles; i++)
+		fprintf(f, "%d %d %d %d %d %d %f %d %s\n", profiles[i].width,
+				profiles[i].height, profiles[i].refresh, profiles[i].x,
+				profiles[i].y, profiles[i].transform, profiles[i].scale,
+				profiles[i].adaptive_sync, profiles[i].id);
+	if (fclose(f) == 0)
+		rename(tmp, profilepath);
+	else
+		unlink(tmp);
+}
+
+void
+sendframe(struct wlr_scene_buffer *buffer, int sx, int sy, void *data)
+{
+	/* What wlr_scene_output_send_frame_done() does, except that clients
+	 * hidden behind others or capped by a rule get fewer frame events */
+	Monitor *m = data;
+	struct wlr_scene_surface *surface;
+	Client *c = NULL;
+	uint32_t ms = frametime.tv_sec * 1000 + frametime.tv_nsec / 1000000;
+	int interval;
+
+	if (buffer->primary_output != m->scene_output)
+		return;
+	if ((surface = wlr_scene_surface_from_buffer(buffer)))
+		toplevel_from_wlr_surface(surface->surface, &c, NULL);
+	if (c && (interval = frameinterval(c)) && c->lastframe != ms) {
+		if (interval < 0) {
+			/* Nor later, until it is shown again */
+			if (c->frame_timer)
+				wl_event_source_timer_update(c->frame_timer, 0);
+			return;
+		}
+		/* Too early, have framedue() send it when it is time instead of
+		 * waiting for the next output frame after that */
+		if (ms - c->lastframe < interval) {
+			if (!c->frame_timer)
+				c->frame_timer = wl_event_loop_add_timer(
+						wl_display_get_event_loop(dpy), framedue, c);
+			wl_event_source_timer_update(c->frame_timer,
+					interval - (ms - c->lastframe));
+			return;
+		}
+		c->lastframe = ms;
+	}
+	wlr_scene_buffer_send_frame_done(buffer, &frametime);
+}
+
 void
 setcursor(struct wl_listener *listener, void *data)
 {
@@ -2028,6 +3282,8 @@ setfloating(Client *c, int floating)
 		return;
 	wlr_scene_node_reparent(&c->scene->node, layers[c->isfullscreen
 			? LyrFS : c->isfloating ? LyrFloat : LyrTile]);
+	scenegen++;
+	occludedirty = 1;
 	arrange(c->mon);
 	printstatus();
 }
@@ -2042,6 +3298,8 @@ setfullscreen(Client *c, int fullscreen)
 	client_set_fullscreen(c, fullscreen);
 	wlr_scene_node_reparent(&c->scene->node, layers[c->isfullscreen
 			? LyrFS : c->isfloating ? LyrFloat : LyrTile]);
+	scenegen++;
+	occludedirty = 1;
 
 	if (fullscreen) {
 		c->prev = c->geom;
@@ -2088,12 +3346,52 @@ void
 setmon(Client *c, Monitor *m, uint32_t newtags)
 {
 	Monitor *oldmon = c->mon;
+	struct wl_list *pos;
+	Client *p;
 
 	if (oldmon == m)
 		return;
+	countclient(c, -1);
 	c->mon = m;
 	c->prev = c->geom;
 
+	/* Keep the tiling and focus order of the global lists: c goes right after
+	 * the closest client before it that is on m */
+	wl_list_remove(&c->mlink);
+	wl_list_init(&c->mlink);
+	wl_list_remove(&c->mflink);
+	wl_list_init(&c->mflink);
+	if (oldmon) {
+		oldmon->topvalid = 0;
+		if (oldmon->cover == c)
+			oldmon->cover = NULL;
+	}
+	if (m) {
+		pos = &m->clients;
+		for (p = wl_container_of(c->link.prev, p, link); &p->link != &clients;
+				p = wl_container_of(p->link.prev, p, link)) {
+			if (p->mon == m) {
+				pos = &p->mlink;
+				break;
+			}
+		}
+		wl_list_insert(pos, &c->mlink);
+
+		pos = &m->fstack;
+		for (p = wl_container_of(c->flink.prev, p, flink); &p->flink != &fstack;
+				p = wl_container_of(p->flink.prev, p, flink)) {
+			if (p->mon == m) {
+				pos = &p->mflink;
+				break;
+			}
+		}
+		wl_list_insert(pos, &c->mflink);
+		m->topvalid = 0;
+	}
+
+	/* A pending resize is rendered on the monitor the client is moved to */
+	trackresize(c, m);
+
 	/* Scene graph sends surface leave/enter events on move and resize */
 	if (oldmon)
 		arrange(oldmon);
@@ -2101,6 +3399,7 @@ setmon(Client *c, Monitor *m, uint32_t newtags)
 		/* Make sure window actually overlaps with the monitor */
 		resize(c, c->geom, 0);
 		c->tags = newtags ? newtags : m->tagset[m->seltags]; /* assign tags of target monitor */
+		countclient(c, +1);
 		setfullscreen(c, c->isfullscreen); /* This will call arrange(c->mon) */
 		setfloating(c, c->isfloating);
 	}
@@ -2132,12 +3431,35 @@ setsel(struct wl_listener *listener, void *data)
 void
 setup(void)
 {
-	int i, sig[] = {SIGCHLD, SIGINT, SIGTERM, SIGPIPE};
-	struct sigaction sa = {.sa_flags = SA_RESTART, .sa_handler = handlesig};
-	sigemptyset(&sa.sa_mask);
+	int i, sv[2], sig[] = {SIGINT, SIGTERM, SIGPIPE};
+	pid_t pid;
+
+	/* Fork the spawn helper while we are still small and have default
+	 * signal handlers */
+	if (spawn_helper) {
+		if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) < 0)
+			die("socketpair:");
+		fcntl(sv[0], F_SETFD, FD_CLOEXEC);
+		fcntl(sv[1], F_SETFD, FD_CLOEXEC);
+		if ((pid = fork()) < 0)
+			die("fork:");
+		if (pid == 0) {
+			close(sv[0]);
+			spawnhelper(sv[1]);
+		}
+		close(sv[1]);
+		spawnfd = sv[0];
+	}
 
-	for (i = 0; i < LENGTH(sig); i++)
-		sigaction(sig[i], &sa, NULL);
+	/* Sort the bindings so that they can be looked up by binary search */
+	for (i = 0; i < LENGTH(keys); i++)
+		keyindex[i] = (Binding){BINDID(keys[i].mod, keys[i].keysym), i};
+	qsort(keyindex, LENGTH(keys), sizeof(*keyindex), bindingcmp);
+	for (i = 0; i < LENGTH(buttons); i++)
+		buttonindex[i] = (Binding){BINDID(buttons[i].mod, buttons[i].button), i};
+	qsort(buttonindex, LENGTH(buttons), sizeof(*buttonindex), bindingcmp);
+	compilerules();
+	loadprofiles();
 
 	wlr_log_init(log_level, NULL);
 
@@ -2145,6 +3467,31 @@ setup(void)
 	 * clients from the Unix socket, manging Wayland globals, and so on. */
 	dpy = wl_display_create();
 
+	/* Signals get blocked and read from a signalfd, so they are handled
+	 * between events instead of interrupting them. Children get the original
+	 * mask back before exec */
+	sigprocmask(SIG_SETMASK, NULL, &origmask);
+	for (i = 0; i < LENGTH(sig); i++)
+		wl_event_loop_add_signal(wl_display_get_event_loop(dpy), sig[i],
+				handlesig, NULL);
+	wl_event_loop_add_signal(wl_display_get_event_loop(dpy), SIGCHLD,
+			handlechild, NULL);
+	wl_event_loop_add_signal(wl_display_get_event_loop(dpy), SIGUSR1,
+			resyncstatus, NULL);
+
+	/* Everything spawned gets its own session and stderr as stdout.
+	 * POSIX_SPAWN_SETSID needs glibc 2.26 or musl 1.1.24, fall back to a new
+	 * process group elsewhere */
+	posix_spawnattr_init(&spawnattr);
+	posix_spawnattr_setsigmask(&spawnattr, &origmask);
+#ifdef POSIX_SPAWN_SETSID
+	posix_spawnattr_setflags(&spawnattr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSID);
+#else
+	posix_spawnattr_setflags(&spawnattr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETPGROUP);
+#endif
+	posix_spawn_file_actions_init(&spawnactions);
+	posix_spawn_file_actions_adddup2(&spawnactions, STDERR_FILENO, STDOUT_FILENO);
+
 	/* The backend is a wlroots feature which abstracts the underlying input and
 	 * output hardware. The autocreate option will choose the most suitable
 	 * backend based on the current environment, such as opening an X11 window
@@ -2211,6 +3558,7 @@ setup(void)
 	 * https://drewdevault.com/2018/07/29/Wayland-shells.html
 	 */
 	wl_list_init(&clients);
+	wl_list_init(&ipcclients);
 	wl_list_init(&fstack);
 
 	idle = wlr_idle_create(dpy);
@@ -2316,12 +3664,85 @@ setup(void)
 void
 spawn(const Arg *arg)
 {
-	if (fork() == 0) {
-		dup2(STDERR_FILENO, STDOUT_FILENO);
-		setsid();
-		execvp(((char **)arg->v)[0], (char **)arg->v);
-		die("dwl: execvp %s failed:", ((char **)arg->v)[0]);
+	char **argv = (char **)arg->v;
+	uint32_t argc = 0;
+	size_t len = sizeof(argc);
+	pid_t pid;
+	int err;
+
+	/* The helper gets argc followed by argv and environ as consecutive
+	 * strings, fall back to spawning ourselves if it can't take them now */
+	if (spawnfd >= 0) {
+		while (argv[argc])
+			argc++;
+		memcpy(spawnbuf, &argc, sizeof(argc));
+		if (packstrings(argv, &len) && packstrings(environ, &len)) {
+			if (send(spawnfd, spawnbuf, len, MSG_DONTWAIT | MSG_NOSIGNAL) >= 0)
+				return;
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				close(spawnfd);
+				spawnfd = -1;
+			}
+		}
+	}
+
+	/* posix_spawn doesn't copy our address space like fork() would */
+	if ((err = posix_spawnp(&pid, argv[0], &spawnactions, &spawnattr,
+			argv, environ)))
+		fprintf(stderr, "dwl: spawn %s failed: %s\n", argv[0], strerror(err));
+}
+
+void
+spawnhelper(int fd)
+{
+	/* This process is forked before the compositor sets anything up, so
+	 * forking it is cheap. Commands are forked twice so that they end up
+	 * in their own session and nobody but init has to reap them */
+	char **argv, *p;
+	uint32_t argc;
+	size_t i;
+	ssize_t n;
+	pid_t pid;
+
+	while ((n = recv(fd, spawnbuf, sizeof(spawnbuf), 0)) != 0) {
+		if (n < 0 && errno != EINTR)
+			_exit(1);
+		memcpy(&argc, spawnbuf, sizeof(argc));
+		if (n <= (ssize_t)sizeof(argc) || spawnbuf[n - 1] || !argc || argc >= n)
+			continue;
+		if ((pid = fork()) == 0) {
+			argv = ecalloc(n + 2, sizeof(*argv));
+			for (i = 0, p = spawnbuf + sizeof(argc); p < spawnbuf + n;
+					p += strlen(p) + 1, i++)
+				argv[i < argc ? i : i + 1] = p;
+			environ = argv + argc + 1;
+			setsid();
+			if (fork() != 0)
+				_exit(0);
+			dup2(STDERR_FILENO, STDOUT_FILENO);
+			execvp(argv[0], argv);
+			die("dwl: execvp %s failed:", argv[0]);
+		}
+		if (pid > 0)
+			waitpid(pid, NULL, 0);
 	}
+	_exit(0);
+}
+
+void
+stageoutput(const struct wlr_output_head_v1_state *state)
+{
+	wlr_output_enable(state->output, state->enabled);
+	if (!state->enabled)
+		return;
+	if (state->mode || !state->custom_mode.width)
+		wlr_output_set_mode(state->output, state->mode);
+	else
+		wlr_output_set_custom_mode(state->output, state->custom_mode.width,
+				state->custom_mode.height, state->custom_mode.refresh);
+	wlr_output_set_transform(state->output, state->transform);
+	wlr_output_set_scale(state->output, state->scale);
+	wlr_output_enable_adaptive_sync(state->output, state->adaptive_sync_enabled);
 }
 
 void
@@ -2335,6 +3756,91 @@ startdrag(struct wl_listener *listener, void *data)
 	wl_signal_add(&drag->icon->events.destroy, &drag_icon_destroy);
 }
 
+char *
+statussnapshot(int incremental, size_t *len)
+{
+	/* Format the status of all monitors, NULL if there's nothing to write */
+	Monitor *m = NULL;
+	Client *c;
+	uint32_t sel;
+	const char *val[StatusLast];
+	char fullscreen[16], floating[16], selected[16], tags[64];
+	char *buf;
+	FILE *f;
+	int i, full = !incremental || statusresync, changed = full;
+
+	if (!(f = open_memstream(&buf, len)))
+		return NULL;
+
+	/* In incremental mode only the lines that changed since the last time are
+	 * written, followed by a sequence number. A full resync starts over. */
+	if (incremental && statusresync)
+		fprintf(f, "resync\n");
+	wl_list_for_each(m, &mons, link) {
+		if ((c = focustop(m))) {
+			val[StatusTitle] = client_get_title(c);
+			val[StatusAppid] = client_get_appid(c);
+			if (!val[StatusTitle])
+				val[StatusTitle] = broken;
+			if (!val[StatusAppid])
+				val[StatusAppid] = broken;
+			snprintf(fullscreen, sizeof(fullscreen), "%u", c->isfullscreen);
+			snprintf(floating, sizeof(floating), "%u", c->isfloating);
+			sel = c->tags;
+		} else {
+			val[StatusTitle] = val[StatusAppid] = "";
+			fullscreen[0] = floating[0] = '\0';
+			sel = 0;
+		}
+		snprintf(selected, sizeof(selected), "%u", m == selmon);
+		snprintf(tags, sizeof(tags), "%u %u %u %u", m->occ, m->tagset[m->seltags],
+				sel, m->urg);
+		val[StatusFullscreen] = fullscreen;
+		val[StatusFloating] = floating;
+		val[StatusSelmon] = selected;
+		val[StatusTags] = tags;
+		val[StatusLayout] = m->ltsymbol;
+
+		for (i = 0; i < StatusLast; i++) {
+			if (!full && m->status[i] && !strcmp(m->status[i], val[i]))
+				continue;
+			fprintf(f, "%s %s %s\n", m->wlr_output->name, statusnames[i], val[i]);
+			if (incremental) {
+				free(m->status[i]);
+				m->status[i] = strdup(val[i]);
+			}
+			changed = 1;
+		}
+	}
+	if (incremental && changed)
+		fprintf(f, "seq %lu\n", ++statusseq);
+	if (incremental)
+		statusresync = 0;
+	if (fclose(f) || !changed || !*len) {
+		free(buf);
+		return NULL;
+	}
+	return buf;
+}
+
+void
+stretchbuffer(struct wlr_scene_buffer *buffer, int sx, int sy, void *data)
+{
+	/* Scale the toplevel's buffer, not its subsurfaces or popups. The scene
+	 * surface resets the size when the client commits a new buffer. */
+	Client *c = data;
+	struct wlr_scene_surface *scene_surface = wlr_scene_surface_from_buffer(buffer);
+	if (scene_surface && scene_surface->surface == client_surface(c))
+		wlr_scene_buffer_set_dest_size(buffer, c->geom.width - 2 * c->bw,
+				c->geom.height - 2 * c->bw);
+}
+
+void
+surfaceframe(struct wlr_surface *surface, int sx, int sy, void *data)
+{
+	wlr_surface_send_frame_done(surface, data);
+}
+
 void
 tag(const Arg *arg)
 {
@@ -2342,7 +3848,10 @@ tag(const Arg *arg)
 	if (!sel || (arg->ui & TAGMASK) == 0)
 		return;
 
+	countclient(sel, -1);
 	sel->tags = arg->ui & TAGMASK;
+	countclient(sel, +1);
+	selmon->topvalid = 0;
 	focusclient(focustop(selmon), 1);
 	arrange(selmon);
 	printstatus();
@@ -2362,7 +3871,7 @@ tile(Monitor *m)
 	unsigned int i, n = 0, mw, my, ty;
 	Client *c;
 
-	wl_list_for_each(c, &clients, link)
+	wl_list_for_each(c, &m->clients, mlink)
 		if (VISIBLEON(c, m) && !c->isfloating && !c->isfullscreen)
 			n++;
 	if (n == 0)
@@ -2373,7 +3882,7 @@ tile(Monitor *m)
 	else
 		mw = m->w.width;
 	i = my = ty = 0;
-	wl_list_for_each(c, &clients, link) {
+	wl_list_for_each(c, &m->clients, mlink) {
 		if (!VISIBLEON(c, m) || c->isfloating || c->isfullscreen)
 			continue;
 		if (i < m->nmaster) {
@@ -2417,7 +3926,10 @@ toggletag(const Arg *arg)
 	if (!newtags)
 		return;
 
+	countclient(sel, -1);
 	sel->tags = newtags;
+	countclient(sel, +1);
+	selmon->topvalid = 0;
 	focusclient(focustop(selmon), 1);
 	arrange(selmon);
 	printstatus();
@@ -2432,11 +3944,27 @@ toggleview(const Arg *arg)
 		return;
 
 	selmon->tagset[selmon->seltags] = newtagset;
+	selmon->topvalid = 0;
 	focusclient(focustop(selmon), 1);
 	arrange(selmon);
 	printstatus();
 }
 
+void
+trackresize(Client *c, Monitor *m)
+{
+	/* Keep c on the pending resizes of m while it has one outstanding. The
+	 * first one on an idle monitor opens a new transaction: rendermon() holds
+	 * back frames until all of them are acked or resize_timeout expires. */
+	wl_list_remove(&c->rlink);
+	wl_list_init(&c->rlink);
+	if (!m || !c->resize)
+		return;
+	if (wl_list_empty(&m->resizes))
+		wl_event_source_timer_update(m->resize_timer, resize_timeout);
+	wl_list_insert(&m->resizes, &c->rlink);
+}
+
 void
 unlocksession(struct wl_listener *listener, void *data)
 {
@@ -2450,7 +3978,9 @@ unmaplayersurfacenotify(struct wl_listener *listener, void *data)
 	LayerSurface *layersurface = wl_container_of(listener, layersurface, unmap);
 
 	layersurface->mapped = 0;
+	layersurface->configured = 0;
 	wlr_scene_node_set_enabled(&layersurface->scene->node, 0);
+	scenegen++;
 	if (layersurface == exclusive_focus)
 		exclusive_focus = NULL;
 	if (layersurface->layer_surface->output
@@ -2460,6 +3990,7 @@ unmaplayersurfacenotify(struct wl_listener *listener, void *data)
 			seat->keyboard_state.focused_surface)
 		focusclient(focustop(selmon), 1);
 	motionnotify(0);
+	checkidleinhibitor(NULL);
 }
 
 void
@@ -2484,9 +4015,17 @@ unmapnotify(struct wl_listener *listener, void *data)
 	}
 
 	wl_list_remove(&c->commit.link);
+	if (c->frame_timer)
+		wl_event_source_timer_update(c->frame_timer, 0);
+	/* Idle inhibitors on the surface must not find the destroyed tree */
+	if (client_surface(c))
+		client_surface(c)->data = NULL;
 	wlr_scene_node_destroy(&c->scene->node);
+	scenegen++;
+	occludedirty = 1;
 	printstatus();
 	motionnotify(0);
+	checkidleinhibitor(client_surface(c));
 }
 
 void
@@ -2503,7 +4042,9 @@ updatemons(struct wl_listener *listener, void *data)
 		wlr_output_configuration_v1_create();
 	Client *c;
 	struct wlr_output_configuration_head_v1 *config_head;
+	struct wlr_box box;
 	Monitor *m;
+	int changed = 0;
 
 	/* First remove from the layout the disabled monitors */
 	wl_list_for_each(m, &mons, link) {
@@ -2511,6 +4052,10 @@ updatemons(struct wl_listener *listener, void *data)
 			continue;
 		config_head = wlr_output_configuration_head_v1_create(config, m->wlr_output);
 		config_head->state.enabled = 0;
+		/* Monitors disabled earlier are closed already */
+		if (!wlr_output_layout_get(output_layout, m->wlr_output))
+			continue;
+		changed = 1;
 		/* Remove this output from the layout to avoid cursor enter inside it */
 		wlr_output_layout_remove(output_layout, m->wlr_output);
 		closemon(m);
@@ -2520,8 +4065,10 @@ updatemons(struct wl_listener *listener, void *data)
 	/* Insert outputs that need to */
 	wl_list_for_each(m, &mons, link)
 		if (m->wlr_output->enabled
-				&& !wlr_output_layout_get(output_layout, m->wlr_output))
+				&& !wlr_output_layout_get(output_layout, m->wlr_output)) {
+			m->autoplace = 1;
 			wlr_output_layout_add_auto(output_layout, m->wlr_output);
+		}
 
 	/* Now that we update the output layout we can get its box */
 	wlr_output_layout_get_box(output_layout, NULL, &sgeom);
@@ -2534,10 +4081,23 @@ updatemons(struct wl_listener *listener, void *data)
 		if (!m->wlr_output->enabled)
 			continue;
 		config_head = wlr_output_configuration_head_v1_create(config, m->wlr_output);
+		config_head->state.enabled = 1;
+		config_head->state.mode = m->wlr_output->current_mode;
+
+		/* Leave monitors and their clients alone unless their box, scale or
+		 * transform changed. Disabling a monitor clears its box */
+		wlr_output_layout_get_box(output_layout, m->wlr_output, &box);
+		config_head->state.x = box.x;
+		config_head->state.y = box.y;
+		if (!memcmp(&box, &m->m, sizeof(box)) && m->scale == m->wlr_output->scale
+				&& m->transform == m->wlr_output->transform)
+			continue;
+		changed = 1;
+		m->scale = m->wlr_output->scale;
+		m->transform = m->wlr_output->transform;
 
 		/* Get the effective monitor geometry to use for surfaces */
-		wlr_output_layout_get_box(output_layout, m->wlr_output, &(m->m));
-		wlr_output_layout_get_box(output_layout, m->wlr_output, &(m->w));
+		m->m = m->w = box;
 		wlr_scene_output_set_position(m->scene_output, m->m.x, m->m.y);
 
 		wlr_scene_node_set_position(&m->fullscreen_bg->node, m->m.x, m->m.y);
@@ -2554,18 +4114,20 @@ updatemons(struct wl_listener *listener, void *data)
 		arrangelayers(m);
 		/* Don't move clients to the left output when plugging monitors */
 		arrange(m);
-
-		config_head->state.enabled = 1;
-		config_head->state.mode = m->wlr_output->current_mode;
-		config_head->state.x = m->m.x;
-		config_head->state.y = m->m.y;
 	}
 
+	/* The frame deferred motion waits for may have been on a monitor that
+	 * is now disabled */
+	flushmotion();
+
 	if (selmon && selmon->wlr_output->enabled) {
 		wl_list_for_each(c, &clients, link)
-			if (!c->mon && client_is_mapped(c))
+			if (!c->mon && client_is_mapped(c)) {
 				setmon(c, selmon, c->tags);
-		focusclient(focustop(selmon), 1);
+				changed = 1;
+			}
+		if (changed)
+			focusclient(focustop(selmon), 1);
 		if (selmon->lock_surface) {
 			client_notify_enter(selmon->lock_surface->surface,
 					wlr_seat_get_keyboard(seat));
@@ -2573,9 +4135,57 @@ updatemons(struct wl_listener *listener, void *data)
 		}
 	}
 
+	if (changed)
+		saveprofiles();
 	wlr_output_manager_v1_set_configuration(output_mgr, config);
 }
 
+void
+updatestatuspage(void)
+{
+	/* Writer side of the seqlock described in status.h */
+	Monitor *m;
+	Client *c;
+	StatusMonitor *s;
+	const char *str;
+	unsigned int seq;
+	uint32_t n = 0;
+
+	if (!statuspage)
+		return;
+	seq = atomic_load_explicit(&statuspage->seq, memory_order_relaxed);
+	atomic_store_explicit(&statuspage->seq, seq + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+
+	wl_list_for_each(m, &mons, link) {
+		if (n == LENGTH(statuspage->mons))
+			break;
+		s = &statuspage->mons[n++];
+		snprintf(s->name, sizeof(s->name), "%s", m->wlr_output->name);
+		snprintf(s->layout, sizeof(s->layout), "%s", m->ltsymbol);
+		s->tagset = m->tagset[m->seltags];
+		s->occ = m->occ;
+		s->urg = m->urg;
+		s->selmon = m == selmon;
+		if ((c = focustop(m))) {
+			snprintf(s->title, sizeof(s->title), "%s",
+					(str = client_get_title(c)) ? str : broken);
+			snprintf(s->appid, sizeof(s->appid), "%s",
+					(str = client_get_appid(c)) ? str : broken);
+			s->fullscreen = c->isfullscreen;
+			s->floating = c->isfloating;
+			s->sel = c->tags;
+		} else {
+			s->title[0] = s->appid[0] = '\0';
+			s->fullscreen = s->floating = -1;
+			s->sel = 0;
+		}
+	}
+	statuspage->nmons = n;
+
+	atomic_store_explicit(&statuspage->seq, seq + 2, memory_order_release);
+}
+
 void
 updatetitle(struct wl_listener *listener, void *data)
 {
@@ -2595,7 +4205,9 @@ urgent(struct wl_listener *listener, void *data)
 
 	if (client_is_mapped(c))
 		client_set_border_color(c, urgentcolor);
+	countclient(c, -1);
 	c->isurgent = 1;
+	countclient(c, +1);
 	printstatus();
 }
 
@@ -2607,6 +4219,7 @@ view(const Arg *arg)
 	selmon->seltags ^= 1; /* toggle sel tagset */
 	if (arg->ui & TAGMASK)
 		selmon->tagset[selmon->seltags] = arg->ui & TAGMASK;
+	selmon->topvalid = 0;
 	focusclient(focustop(selmon), 1);
 	arrange(selmon);
 	printstatus();
@@ -2619,6 +4232,43 @@ virtualkeyboard(struct wl_listener *listener, void *data)
 	createkeyboard(&keyboard->keyboard);
 }
 
+void
+writestatus(void *data)
+{
+	IpcClient *ic, *tmp;
+	char *buf;
+	size_t len;
+
+	status_source = NULL;
+	updatestatuspage();
+	if (!wl_list_empty(&ipcclients) && (buf = statussnapshot(0, &len))) {
+		wl_list_for_each_safe(ic, tmp, &ipcclients, link)
+			if (ic->subscribed)
+				ipcsend(ic, buf, len);
+		free(buf);
+	}
+
+	/* A pending diff that gets replaced below would take its changes with
+	 * it, so send everything again instead */
+	if (status_incremental && statusbuf[statusoff ? 1 : 0])
+		statusresync = 1;
+	if (!(buf = statussnapshot(status_incremental, &len)))
+		return;
+
+	/* A snapshot that is partially written has to be finished, any other one
+	 * is out of date and gets replaced */
+	if (statusoff) {
+		free(statusbuf[1]);
+		statusbuf[1] = buf;
+		statuslen[1] = len;
+	} else {
+		free(statusbuf[0]);
+		statusbuf[0] = buf;
+		statuslen[0] = len;
+	}
+	flushstatus(STDOUT_FILENO, 0, NULL);
+}
+
 Monitor *
 xytomon(double x, double y)
 {
@@ -2630,19 +4280,34 @@ void
 xytonode(double x, double y, struct wlr_surface **psurface,
 		Client **pc, LayerSurface **pl, double *nx, double *ny)
 {
-	struct wlr_scene_node *node, *pnode;
+	struct wlr_scene_node *node, *pnode, *snode = NULL;
 	struct wlr_surface *surface = NULL;
 	Client *c = NULL;
 	LayerSurface *l = NULL;
-	int layer;
+	int layer, nhits = 0;
+
+	/* Nothing changed since the last hit and the point is still on its surface */
+	if (hit.surface && hit.gen == scenegen && wlr_box_contains_point(&hit.box, x, y)
+			&& wlr_surface_point_accepts_input(hit.surface,
+				x - hit.box.x, y - hit.box.y)) {
+		surface = hit.surface;
+		c = hit.c;
+		l = hit.l;
+		if (nx) *nx = x - hit.box.x;
+		if (ny) *ny = y - hit.box.y;
+		goto out;
+	}
 
 	for (layer = NUM_LAYERS - 1; !surface && layer >= 0; layer--) {
 		if (!(node = wlr_scene_node_at(&layers[layer]->node, x, y, nx, ny)))
 			continue;
+		nhits++;
 
-		if (node->type == WLR_SCENE_NODE_BUFFER)
+		if (node->type == WLR_SCENE_NODE_BUFFER) {
 			surface = wlr_scene_surface_from_buffer(
 					wlr_scene_buffer_from_node(node))->surface;
+			snode = node;
+		}
 		/* Walk the tree to find a node that knows the client */
 		for (pnode = node; pnode && !c; pnode = &pnode->parent->node)
 			c = pnode->data;
@@ -2652,6 +4317,29 @@ xytonode(double x, double y, struct wlr_surface **psurface,
 		}
 	}
 
+	/* Remember the hit, but only if nothing else is shown on top of any part
+	 * of the surface, so that the whole of its box can be trusted */
+	if (hit.surface)
+		destroyhitsurface(&hit.destroy, NULL);
+	if (surface && nhits == 1) {
+		wlr_scene_node_coords(snode, &hit.box.x, &hit.box.y);
+		hit.box.width = surface->current.width;
+		hit.box.height = surface->current.height;
+		for (node = snode; node->parent; node = &node->parent->node)
+			for (pnode = wl_container_of(node->link.next, pnode, link);
+					&pnode->link != &node->parent->children;
+					pnode = wl_container_of(pnode->link.next, pnode, link))
+				if (nodeintersects(pnode, &hit.box))
+					goto out;
+		hit.surface = surface;
+		hit.c = c;
+		hit.l = l;
+		hit.gen = scenegen;
+		wl_signal_add(&surface->events.commit, &hit.commit);
+		wl_signal_add(&surface->events.destroy, &hit.destroy);
+	}
+
+out:
 	if (psurface) *psurface = surface;
 	if (pc) *pc = c;
 	if (pl) *pl = l;
@@ -2667,7 +4355,7 @@ zoom(const Arg *arg)
 
 	/* Search for the first tiled window that is not sel, marking sel as
 	 * NULL if we pass it along the way */
-	wl_list_for_each(c, &clients, link)
+	wl_list_for_each(c, &selmon->clients, mlink)
 		if (VISIBLEON(c, selmon) && !c->isfloating) {
 			if (c != sel)
 				break;
@@ -2675,7 +4363,7 @@ zoom(const Arg *arg)
 		}
 
 	/* Return if no other tiled window was found */
-	if (&c->link == &clients)
+	if (&c->mlink == &selmon->clients)
 		return;
 
 	/* If we passed sel, move c to the front; otherwise, move sel to the
@@ -2684,6 +4372,8 @@ zoom(const Arg *arg)
 		sel = c;
 	wl_list_remove(&sel->link);
 	wl_list_insert(&clients, &sel->link);
+	wl_list_remove(&sel->mlink);
+	wl_list_insert(&selmon->clients, &sel->mlink);
 
 	focusclient(sel, 1);
 	arrange(selmon);
@@ -2725,6 +4415,9 @@ createnotifyx11(struct wl_listener *listener, void *data)
 	c->surface.xwayland = xsurface;
 	c->type = xsurface->override_redirect ? X11Unmanaged : X11Managed;
 	c->bw = borderpx;
+	wl_list_init(&c->mlink);
+	wl_list_init(&c->mflink);
+	wl_list_init(&c->rlink);
 
 	/* Listen to the various events it can emit */
 	LISTEN(&xsurface->events.map, &c->map, mapnotify);
@@ -2757,7 +4450,9 @@ sethints(struct wl_listener *listener, void *data)
 	if (c == focustop(selmon))
 		return;
 
+	countclient(c, -1);
 	c->isurgent = xcb_icccm_wm_hints_get_urgency(c->surface.xwayland->hints);
+	countclient(c, +1);
 
 	if (c->isurgent && client_is_mapped(c))
 		client_set_border_color(c, urgentcolor);
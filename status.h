@@ -0,0 +1,31 @@
+/*
+ * Layout of the status page dwl keeps in the file named by $DWL_STATUS, see
+ * dwl(1). Map it read-only and use it as a seqlock: load seq, retry if it is
+ * odd, copy what you need, then retry if seq changed in the meantime.
+ *
+ *	do {
+ *		while ((seq = atomic_load_explicit(&page->seq, memory_order_acquire)) & 1);
+ *		copy = *page;
+ *		atomic_thread_fence(memory_order_acquire);
+ *	} while (atomic_load_explicit(&page->seq, memory_order_relaxed) != seq);
+ */
+#include <stdatomic.h>
+#include <stdint.h>
+
+typedef struct {
+	char name[32]; /* output name */
+	char layout[16]; /* layout symbol */
+	char title[256]; /* of the focused client, empty if there is none */
+	char appid[256];
+	int32_t fullscreen, floating; /* of the focused client, -1 if there is none */
+	uint32_t tagset; /* selected tags */
+	uint32_t occ, urg; /* tags with clients, with urgent clients */
+	uint32_t sel; /* tags of the focused client */
+	uint32_t selmon; /* 1 for the selected monitor */
+} StatusMonitor;
+
+typedef struct {
+	atomic_uint seq; /* odd while the page is being updated */
+	uint32_t nmons;
+	StatusMonitor mons[16];
+} StatusPage;